@@ -0,0 +1,177 @@
+#include "acpi.h"
+#include "libk/kstring.h"
+#include "libk/kstdio.h"
+#include "memory/pmm.h"
+
+/* Root table: entries are 64 bit in the XSDT, 32 bit in the RSDT */
+static const struct acpi_sdt_header* root;
+static int root_entry_size;
+
+#define SRAT_HEADER_SIZE		(sizeof(struct acpi_sdt_header) + 12)
+#define SRAT_MEMORY_AFFINITY	1
+#define SRAT_MEMORY_ENABLED		(1 << 0)
+
+struct srat_entry {
+	uint8_t type;
+	uint8_t length;
+} __attribute__ ((packed));
+
+struct srat_memory_affinity {
+	uint8_t type;
+	uint8_t length;
+	uint32_t domain;
+	uint16_t reserved0;
+	uint64_t base;
+	uint64_t length_bytes;
+	uint32_t reserved1;
+	uint32_t flags;
+	uint64_t reserved2;
+} __attribute__ ((packed));
+
+_Static_assert (sizeof(struct srat_memory_affinity) == 40, "");
+
+struct slit {
+	struct acpi_sdt_header header;
+	uint64_t localities;
+	uint8_t distance[]; // localities x localities
+} __attribute__ ((packed));
+
+static bool
+checksum_valid (const void* table, size_t length)
+{
+	const uint8_t* p = table;
+	uint8_t sum = 0;
+
+	for ( size_t i=0; i<length; i++ )
+		sum += p[i];
+
+	return sum == 0;
+}
+
+bool
+acpi_initialise (const struct RSDPDescriptor* rsdp)
+{
+	root = NULL;
+
+	if (!rsdp || memcmp (rsdp->Signature, "RSD PTR ", 8) != 0
+		|| !checksum_valid (rsdp, sizeof(*rsdp)))
+		return false;
+
+	if (rsdp->Revision >= 2) {
+		const struct RSDPDescriptor20* rsdp20 = (const void*)rsdp;
+		if (rsdp20->XsdtAddress && checksum_valid (rsdp20, rsdp20->Length)) {
+			root = HHDM_POINTER (rsdp20->XsdtAddress);
+			root_entry_size = sizeof(uint64_t);
+		}
+	}
+
+	if (!root) {
+		root = HHDM_POINTER (rsdp->RsdtAddress);
+		root_entry_size = sizeof(uint32_t);
+	}
+
+	if (!checksum_valid (root, root->length)) {
+		eprintf ("Warning: ACPI root table %.4s is corrupt\n", root->signature);
+		root = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+const struct acpi_sdt_header*
+acpi_find_table (const char* signature)
+{
+	if (!root)
+		return NULL;
+
+	const uint8_t* entries = (const uint8_t*)(root + 1);
+	int count = (root->length - sizeof(*root)) / root_entry_size;
+
+	for ( int i=0; i<count; i++ ) {
+		// Entries are not naturally aligned in the XSDT
+		uint64_t address = 0;
+		memcpy (&address, entries + i * root_entry_size, root_entry_size);
+
+		const struct acpi_sdt_header* table = HHDM_POINTER (address);
+		if (memcmp (table->signature, signature, 4) != 0)
+			continue;
+
+		if (checksum_valid (table, table->length))
+			return table;
+
+		eprintf ("Warning: ACPI table %.4s is corrupt\n", signature);
+	}
+
+	return NULL;
+}
+
+int
+acpi_srat_memory (struct acpi_memory_affinity* ranges, int max)
+{
+	const struct acpi_sdt_header* srat = acpi_find_table ("SRAT");
+	if (!srat)
+		return 0;
+
+	const uint8_t* p = (const uint8_t*)srat + SRAT_HEADER_SIZE;
+	const uint8_t* end = (const uint8_t*)srat + srat->length;
+	int count = 0;
+
+	while (p + sizeof(struct srat_entry) <= end) {
+		const struct srat_entry* entry = (const void*)p;
+		if (entry->length < sizeof(*entry) || p + entry->length > end)
+			break;
+
+		const struct srat_memory_affinity* mem = (const void*)p;
+		if (entry->type == SRAT_MEMORY_AFFINITY
+			&& entry->length >= sizeof(*mem)
+			&& (mem->flags & SRAT_MEMORY_ENABLED)
+			&& mem->length_bytes)
+		{
+			if (count == max) {
+				eprintf ("Warning: SRAT memory range %zx+%zx ignored (%s)\n",
+						 mem->base, mem->length_bytes, "too many ranges");
+			} else {
+				ranges[count++] = (struct acpi_memory_affinity) {
+					.base = mem->base,
+					.length = mem->length_bytes,
+					.domain = mem->domain,
+				};
+			}
+		}
+
+		p += entry->length;
+	}
+
+	return count;
+}
+
+static const struct slit*
+slit_table (void)
+{
+	const struct slit* slit = (const void*)acpi_find_table ("SLIT");
+	if (!slit || slit->header.length < sizeof(*slit))
+		return NULL;
+
+	if (sizeof(*slit) + slit->localities * slit->localities > slit->header.length)
+		return NULL;
+
+	return slit;
+}
+
+int
+acpi_slit_localities (void)
+{
+	const struct slit* slit = slit_table ();
+	return slit ? slit->localities : 0;
+}
+
+int
+acpi_slit_distance (uint32_t from, uint32_t to)
+{
+	const struct slit* slit = slit_table ();
+	if (!slit || from >= slit->localities || to >= slit->localities)
+		return 0;
+
+	return slit->distance[from * slit->localities + to];
+}
@@ -0,0 +1,69 @@
+#pragma once
+/*
+ * ACPI table lookup.
+ *
+ * Tables are read in place through the HHDM, nothing is copied. Only the
+ * tables the kernel currently needs are decoded: SRAT and SLIT, for NUMA.
+ */
+
+#include "types.h"
+
+struct RSDPDescriptor {
+ char Signature[8];
+ uint8_t Checksum;
+ char OEMID[6];
+ uint8_t Revision;
+ uint32_t RsdtAddress;
+} __attribute__ ((packed));
+
+struct RSDPDescriptor20 {
+ struct RSDPDescriptor firstPart;
+
+ uint32_t Length;
+ uint64_t XsdtAddress;
+ uint8_t ExtendedChecksum;
+ uint8_t reserved[3];
+} __attribute__ ((packed));
+
+/* Common header of every system description table */
+struct acpi_sdt_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__ ((packed));
+
+
+/* Find the root table (XSDT, or RSDT before ACPI 2.0) from the RSDP.
+ * Returns false if the RSDP is not valid */
+bool acpi_initialise (const struct RSDPDescriptor* rsdp);
+
+
+/* Returns the table with the 4 character signature (e.g. "SRAT"),
+ * NULL if there is none or its checksum is wrong */
+const struct acpi_sdt_header* acpi_find_table (const char* signature);
+
+
+/* Memory range local to a NUMA proximity domain */
+struct acpi_memory_affinity {
+	physical_t base;
+	size_t length;
+	uint32_t domain;
+};
+
+/* Fill ranges with up to max enabled memory ranges from the SRAT.
+ * Returns the number of ranges, 0 if there is no SRAT (not NUMA) */
+int acpi_srat_memory (struct acpi_memory_affinity* ranges, int max);
+
+
+/* Number of proximity domains in the SLIT, 0 if there is none */
+int acpi_slit_localities (void);
+
+/* Relative cost for domain from of accessing memory in domain to,
+ * 10 = local. Returns 0 if unknown */
+int acpi_slit_distance (uint32_t from, uint32_t to);
@@ -0,0 +1,12 @@
+#include "cpu.h"
+
+#define WEAK __attribute__((weak))
+
+/* Only the bootstrap processor runs for now. SMP startup should override
+ * this with an architecture specific version (e.g. reading a per-CPU
+ * segment base) */
+WEAK int
+cpu_current_index (void)
+{
+	return 0;
+}
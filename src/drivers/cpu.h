@@ -0,0 +1,14 @@
+#pragma once
+/*
+ * Per-CPU identification.
+ *
+ * Structures with per-CPU state are arrays of CPU_MAX entries, indexed by
+ * cpu_current_index. The index must be stable while it is in use, so callers
+ * must not be migrated between cores (there is no scheduler yet, so this is
+ * trivially true).
+ */
+
+#define CPU_MAX 16
+
+/* Index of the executing CPU, in range [0, CPU_MAX) */
+int cpu_current_index (void);
@@ -0,0 +1,29 @@
+#include "interrupt.h"
+
+#define WEAK __attribute__((weak))
+
+static interrupt_page_fault_handler page_fault_handler;
+static void* page_fault_context;
+
+/* No exception handling without an architecture specific version */
+WEAK void
+interrupt_initialise (void)
+{
+}
+
+void
+interrupt_set_page_fault_handler (interrupt_page_fault_handler handler,
+								  void* context)
+{
+	page_fault_handler = handler;
+	page_fault_context = context;
+}
+
+bool
+interrupt_page_fault (void* address, bool is_write)
+{
+	if (!page_fault_handler)
+		return false;
+
+	return page_fault_handler (address, is_write, page_fault_context);
+}
@@ -0,0 +1,24 @@
+#pragma once
+/*
+ * CPU exception handling.
+ *
+ * Only page faults for pages that are not present are handled for now.
+ * A handler returns true once it has mapped the page, and the faulting
+ * access is retried. Any other fault is fatal.
+ */
+
+#include "types.h"
+
+typedef bool (*interrupt_page_fault_handler)(void* address, bool is_write,
+											 void* context);
+
+/* Install the exception table for this CPU */
+void interrupt_initialise (void);
+
+/* Set the (single) handler for page faults, NULL to remove it */
+void interrupt_set_page_fault_handler (interrupt_page_fault_handler,
+									   void* context);
+
+/* Called by the architecture code on a fault for a missing page.
+ * Returns false if the fault could not be resolved */
+bool interrupt_page_fault (void* address, bool is_write);
@@ -0,0 +1,37 @@
+.intel_syntax noprefix
+
+	.text
+
+	.global	interrupt_page_fault_entry
+	.type interrupt_page_fault_entry, @function
+
+# CPU has pushed the error code. Save what a C call may clobber
+interrupt_page_fault_entry:
+	push	rax
+	push	rcx
+	push	rdx
+	push	rsi
+	push	rdi
+	push	r8
+	push	r9
+	push	r10
+	push	r11
+	mov	rdi, cr2		# address
+	mov	rsi, [rsp + 72]		# error code
+	cld
+	sub	rsp, 8			# 16 byte align for the call
+	call	interrupt_page_fault_x86
+	add	rsp, 8
+	pop	r11
+	pop	r10
+	pop	r9
+	pop	r8
+	pop	rdi
+	pop	rsi
+	pop	rdx
+	pop	rcx
+	pop	rax
+	add	rsp, 8			# error code
+	iretq
+
+	.size	interrupt_page_fault_entry, .-interrupt_page_fault_entry
@@ -0,0 +1,74 @@
+#include "interrupt.h"
+#include "panic.h"
+
+/* x86_64 interrupt descriptor table. Only the page fault vector is set,
+ * any other exception still brings the machine down */
+
+#define IDT_VECTORS				256
+#define IDT_PAGE_FAULT			14
+#define IDT_INTERRUPT_GATE		0x8e // Present, ring 0
+
+// Page fault error code
+#define PF_PRESENT				(1 << 0)
+#define PF_WRITE				(1 << 1)
+
+struct idt_gate {
+	uint16_t offset_low;
+	uint16_t selector;
+	uint8_t ist;
+	uint8_t type;
+	uint16_t offset_mid;
+	uint32_t offset_high;
+	uint32_t reserved;
+} __attribute__ ((packed));
+
+_Static_assert (sizeof(struct idt_gate) == 16, "");
+
+static struct idt_gate idt[IDT_VECTORS] __attribute__((aligned(16)));
+
+/* interrupt_entry_x86.s */
+void interrupt_page_fault_entry (void);
+void interrupt_page_fault_x86 (void* address, uint64_t error_code);
+
+static void
+idt_set_gate (int vector, void (*entry)(void))
+{
+	uint16_t cs;
+	asm ("mov\t%%cs, %0" : "=r" (cs));
+
+	uintptr_t offset = (uintptr_t)entry;
+	idt[vector] = (struct idt_gate) {
+		.offset_low = offset,
+		.selector = cs,
+		.type = IDT_INTERRUPT_GATE,
+		.offset_mid = offset >> 16,
+		.offset_high = offset >> 32,
+	};
+}
+
+void
+interrupt_initialise (void)
+{
+	idt_set_gate (IDT_PAGE_FAULT, interrupt_page_fault_entry);
+
+	struct {
+		uint16_t limit;
+		uint64_t base;
+	} __attribute__ ((packed)) idtr = {
+		.limit = sizeof(idt) - 1,
+		.base = (uintptr_t)idt,
+	};
+
+	asm volatile ("lidt\t%0" : : "m" (idtr));
+}
+
+void
+interrupt_page_fault_x86 (void* address, uint64_t error_code)
+{
+	// Protection faults are never a missing page
+	if (!(error_code & PF_PRESENT)
+		&& interrupt_page_fault (address, error_code & PF_WRITE))
+		return;
+
+	panic ("Page fault at %p (error %lx)\n", address, error_code);
+}
@@ -13,18 +13,34 @@
  * The top half is code for iterating through the parts of the page tables.
  * We use a callback based api which makes extending new features much easier.
  * There's one main function `apply_nodes` that does most of the iteration, and
- * various node_callback_ and leaf_callback_ functions that modify the tree.
+ * various node_callback_ functions that modify the tree.
+ *
+ * Ranges are mapped with the largest pages that fit: an entry of a PML2 (or,
+ * if the CPU supports it, PML3) table maps 2M (1G) directly when the whole
+ * entry is covered and the physical address is aligned to match. Callbacks
+ * that only touch part of such a huge page split it into a table of smaller
+ * pages first.
+ *
+ * Callbacks never invalidate or free anything directly. They record what
+ * they changed in a tlb_batch, which each public function flushes once at
+ * the end.
  *
  * The bottom half of this file is the public api. Most functions here should
  * just call `apply_nodes_entry` with appropriate callbacks in place.
  */
 
 static pmm_t global_mmu_pmm;
+static bool global_mmu_1g_pages;
 
 void
 mmu_initialise (pmm_t pmm)
 {
 	global_mmu_pmm = pmm;
+
+	// CPUID.80000001H:EDX.Page1GB[bit 26]
+	uint32_t eax = 0x80000001, ebx, ecx = 0, edx;
+	asm ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+	global_mmu_1g_pages = edx & (1U << 26);
 }
 
 bool
@@ -77,12 +93,194 @@ static const page_map_entry_t PM_PERMS =
 static physical_t
 allocate ()
 {
-	physical_t page = pmm_allocate_page (global_mmu_pmm);
+	physical_t page = pmm_allocate_zeroed_page (global_mmu_pmm);
 	assert (page, "Failed to allocate page table");
-	memset (HHDM_POINTER (page), 0, PAGE_SIZE);
 	return page;
 }
 
+/* TLB flush batches
+ *
+ * Changes to present entries are recorded in a tlb_batch instead of being
+ * invalidated one by one, and flushed when the whole operation is done:
+ * with invlpg for each page if there are only a few, otherwise by reloading
+ * CR3. Pages the tables no longer use (and memory they mapped, for
+ * mmu_remove_free) are held in the batch until then, so nothing can reach
+ * them through a stale translation. Shooting down other CPUs' TLBs will go
+ * in tlb_flush too, once there are other CPUs */
+
+/* Past this many pages a full flush is cheaper than invlpg for each, as
+ * refilling the TLB costs less than the invlpgs themselves */
+#define TLB_FLUSH_PAGES 32
+
+/* Pages held back until the flush. A full batch flushes early */
+#define TLB_FREE_PAGES 64
+
+enum tlb_free_kind {
+	TLB_FREE_MEMORY, // To the batch's pmm
+	TLB_FREE_TABLE,
+	TLB_FREE_CLEAN_TABLE, // All entries 0, back to the zeroed pool
+};
+
+struct tlb_batch {
+	pmm_t pmm;
+	int pages; // Past TLB_FLUSH_PAGES means flush everything
+	uintptr_t page[TLB_FLUSH_PAGES];
+	int frees;
+	physical_t free[TLB_FREE_PAGES]; // page | kind | order << 2
+};
+
+static void
+tlb_invalidate (struct tlb_batch* tlb, uintptr_t address)
+{
+	if (tlb->pages < TLB_FLUSH_PAGES)
+		tlb->page[tlb->pages++] = address;
+	else
+		tlb->pages = TLB_FLUSH_PAGES + 1;
+}
+
+static void
+tlb_flush (struct tlb_batch* tlb)
+{
+	if (tlb->pages > TLB_FLUSH_PAGES) {
+		uintptr_t cr3;
+		asm volatile ("mov\t%%cr3,%0\n\tmov\t%0,%%cr3" : "=r"(cr3) : : "memory");
+	} else {
+		for (int i=0; i<tlb->pages; i++)
+			asm volatile ("invlpg\t(%0)" : : "r" (tlb->page[i]) : "memory");
+	}
+	tlb->pages = 0;
+
+	for (int i=0; i<tlb->frees; i++) {
+		physical_t page = ROUND_DOWN_P2 (tlb->free[i], PAGE_SIZE);
+		int order = (tlb->free[i] >> 2) & 0xf;
+
+		switch (tlb->free[i] & 3) {
+		case TLB_FREE_MEMORY:
+			pmm_free_pages_order (tlb->pmm, page, order);
+			break;
+		case TLB_FREE_TABLE:
+			pmm_free_page (global_mmu_pmm, page);
+			break;
+		case TLB_FREE_CLEAN_TABLE:
+			pmm_free_zeroed_page (global_mmu_pmm, page);
+			break;
+		}
+	}
+	tlb->frees = 0;
+}
+
+/* Free page (a run of 2^order pages) after the next flush */
+static void
+tlb_free (struct tlb_batch* tlb, physical_t page, enum tlb_free_kind kind,
+		  int order)
+{
+	// Tables the bootloader built were never the pmm's to take back
+	if (kind != TLB_FREE_MEMORY && !pmm_page (global_mmu_pmm, page))
+		return;
+
+	if (tlb->frees == TLB_FREE_PAGES)
+		tlb_flush (tlb);
+
+	tlb->free[tlb->frees++] = page | kind | order << 2;
+}
+
+/* Memory covered by one entry of a table at depth */
+static inline uintptr_t
+entry_size (int depth)
+{
+	return 1ULL << depth_shift_size[depth];
+}
+
+/* Whether entries of a table at depth can map memory directly */
+static inline bool
+huge_allowed (int depth)
+{
+	return depth == PAGE_MAP_DEPTH_2
+		|| (depth == PAGE_MAP_DEPTH_1 && global_mmu_1g_pages);
+}
+
+/* An entry of a table at depth maps a huge page. In the bottom level
+ * tables the PS bit means something else (PAT) */
+static inline bool
+is_huge (page_map_entry_t entry, int depth)
+{
+	return depth < PAGE_MAP_DEPTH_BOTTOM && (entry & MMU_REG_PAGE_SIZE);
+}
+
+/* Replace the huge page entry at address, in a table at depth, by a table
+ * of smaller pages mapping the same memory */
+static void
+split_huge (page_map_entry_t* entry, int depth, uintptr_t address,
+			struct tlb_batch* tlb)
+{
+	physical_t phys = *entry & MMU_REG_PHYS_ADDRESS_MASK;
+	page_map_entry_t flags = *entry & ~MMU_REG_PHYS_ADDRESS_MASK;
+	const uintptr_t size = entry_size (depth + 1);
+
+	// Bottom level entries are always 4K
+	if (depth + 1 == PAGE_MAP_DEPTH_BOTTOM)
+		flags &= ~MMU_REG_PAGE_SIZE;
+
+	physical_t page = allocate ();
+	struct mmu_page_map_table* table = HHDM_POINTER (page);
+	for (int i=0; i<MMU_REG_PAGE_MAP_ENTRY_COUNT; i++)
+		table->entry[i] = (phys + i * size) | flags;
+
+	*entry = page | PM_PERMS;
+	tlb_invalidate (tlb, ROUND_DOWN_P2 (address, entry_size (depth)));
+}
+
+/* Free a table and the tables below it, not the memory they map. The
+ * caller must have unlinked it already.
+ *
+ * Every translation made through the tables is dropped, and they may be
+ * cached at a different page size than whatever replaces them. Rather than
+ * record each one, the batch does a full flush */
+static void
+free_tables (struct mmu_page_map_part part, struct tlb_batch* tlb)
+{
+	struct mmu_page_map_table* table = HHDM_POINTER (part.page);
+
+	tlb->pages = TLB_FLUSH_PAGES + 1;
+
+	for (int i=0; part.depth < PAGE_MAP_DEPTH_BOTTOM
+				  && i<MMU_REG_PAGE_MAP_ENTRY_COUNT; i++) {
+		page_map_entry_t entry = table->entry[i];
+		if ((entry & MMU_REG_PRESENT) && !is_huge (entry, part.depth))
+			free_tables ((struct mmu_page_map_part) {
+				.page = entry & MMU_REG_PHYS_ADDRESS_MASK,
+				.depth = part.depth + 1,
+			}, tlb);
+	}
+
+	tlb_free (tlb, part.page, TLB_FREE_TABLE, 0);
+}
+
+/* The entry for address in its table at depth, creating the tables above
+ * it (and splitting huge pages in the way) as needed */
+static page_map_entry_t*
+walk_create (struct mmu_page_map_part top, uintptr_t address, int depth,
+			 struct tlb_batch* tlb)
+{
+	physical_t page = top.page;
+
+	for (int d = top.depth; ; d++) {
+		struct mmu_page_map_table* table = HHDM_POINTER (page);
+		page_map_entry_t* entry =
+			&table->entry[(address >> depth_shift_size[d]) & MMU_REG_VIRT_MASK];
+
+		if (d == depth)
+			return entry;
+
+		if (!(*entry & MMU_REG_PRESENT))
+			*entry = allocate () | PM_PERMS;
+		else if (is_huge (*entry, d))
+			split_huge (entry, d, address, tlb);
+
+		page = *entry & MMU_REG_PHYS_ADDRESS_MASK;
+	}
+}
+
 /* Top half - Iteration through nodes */
 
 /* Which part of the page table tree we are working on.
@@ -144,20 +342,53 @@ apply_nodes (
 #undef SHIFTL
 }
 
+struct node_callback_assign_ctx {
+	physical_t p_base;
+	uintptr_t v_base;
+	page_map_entry_t flags;
+	struct tlb_batch* tlb;
+};
+
+/* Maps the range linearly, using huge pages where they fit */
 static void
-node_callback_reserve (
+node_callback_assign (
 	struct node_command_loc loc,
 	page_map_entry_t* entry,
 	void* ctx
 ){
-	if (!(*entry & MMU_REG_PRESENT)) {
-		page_map_entry_t next = allocate ();
-		*entry = next | PM_PERMS;
-		loc.page.page = next;
+	struct node_callback_assign_ctx* data = ctx;
+	const int depth = loc.page.depth - 1; // Of the table holding entry
+	physical_t addr = loc.start - data->v_base + data->p_base;
+
+	if (loc.page.depth == PAGE_MAP_DEPTH_MEMORY) {
+		if (*entry & MMU_REG_PRESENT)
+			tlb_invalidate (data->tlb, loc.start);
+		*entry = addr | data->flags;
+		return;
 	}
 
-	if (loc.page.depth < PAGE_MAP_DEPTH_BOTTOM)
-		apply_nodes (loc, node_callback_reserve, NULL);
+	// Whole entry covered, and the memory is aligned to match
+	const uintptr_t size = entry_size (depth);
+	if (huge_allowed (depth) && loc.end - loc.start == size
+		&& (addr & (size - 1)) == 0)
+	{
+		page_map_entry_t old = *entry;
+		*entry = addr | data->flags | MMU_REG_PAGE_SIZE;
+
+		if ((old & MMU_REG_PRESENT) && !is_huge (old, depth))
+			free_tables (loc.page, data->tlb);
+		else if (old & MMU_REG_PRESENT)
+			tlb_invalidate (data->tlb, loc.start);
+		return;
+	}
+
+	if (!(*entry & MMU_REG_PRESENT))
+		*entry = allocate () | PM_PERMS;
+	else if (is_huge (*entry, depth))
+		split_huge (entry, depth, loc.start, data->tlb);
+
+	loc.page.page = *entry & MMU_REG_PHYS_ADDRESS_MASK;
+	apply_nodes (loc, node_callback_assign, ctx);
 }
 
 static void
@@ -166,11 +397,11 @@ node_callback_gc (
 	page_map_entry_t* entry,
 	void* ctx
 ){
-	if (!(*entry & MMU_REG_PRESENT))
+	if (!(*entry & MMU_REG_PRESENT) || is_huge (*entry, loc.page.depth - 1))
 		return;
 
 	if (loc.page.depth < PAGE_MAP_DEPTH_BOTTOM)
-		apply_nodes (loc, node_callback_gc, NULL);
+		apply_nodes (loc, node_callback_gc, ctx);
 
 	struct mmu_page_map_table* table = HHDM_POINTER (loc.page.page);
 
@@ -179,62 +410,119 @@ node_callback_gc (
 		if (entry & MMU_REG_PRESENT)
 			goto not_empty;
 	}
+	// Cleared entries are always 0, so the table is a clean page again
 	*entry = 0;
-	pmm_free_page (global_mmu_pmm, loc.page.page);
+	tlb_invalidate (ctx, loc.start);
+	tlb_free (ctx, loc.page.page, TLB_FREE_CLEAN_TABLE, 0);
 
 not_empty:;
 }
 
-typedef void (*leaf_callback)(
-	uintptr_t virt_addr,
-	page_map_entry_t* entry,
-	void* ctx
-);
+/* Free the memory of a leaf in a table at depth. Huge pages go back as
+ * runs of the largest order the pmm has */
+_Static_assert ((PAGE_SIZE << PMM_MAX_ORDER) == 1 << MMU_REG_VIRT_SHIFT_PML2,
+				"2M pages must be one pmm run");
 
-struct node_callback_leaf_ctx {
-	leaf_callback callback;
-	void* ctx;
-};
+static void
+free_leaf (struct tlb_batch* tlb, physical_t phys, int depth)
+{
+	const uintptr_t size = entry_size (depth);
 
+	if (size == PAGE_SIZE) {
+		tlb_free (tlb, phys, TLB_FREE_MEMORY, 0);
+		return;
+	}
+
+	for (uintptr_t off = 0; off < size; off += PAGE_SIZE << PMM_MAX_ORDER)
+		tlb_free (tlb, phys + off, TLB_FREE_MEMORY, PMM_MAX_ORDER);
+}
+
+/* Clears present leaves, and frees their pages to the batch's pmm if not
+ * NULL. Missing tables are skipped rather than walked, huge pages only
+ * partly in range are split first */
 static void
-node_callback_leaf (
+node_callback_clear (
 	struct node_command_loc loc,
 	page_map_entry_t* entry,
 	void* ctx
 ){
-	if (loc.page.depth <= PAGE_MAP_DEPTH_BOTTOM) {
-		apply_nodes (loc, node_callback_leaf, ctx);
+	struct tlb_batch* tlb = ctx;
+	const int depth = loc.page.depth - 1;
+
+	if (!(*entry & MMU_REG_PRESENT))
 		return;
+
+	if (loc.page.depth <= PAGE_MAP_DEPTH_BOTTOM) {
+		if (!is_huge (*entry, depth)
+			|| loc.end - loc.start < entry_size (depth))
+		{
+			if (is_huge (*entry, depth))
+				split_huge (entry, depth, loc.start, tlb);
+
+			loc.page.page = *entry & MMU_REG_PHYS_ADDRESS_MASK;
+			apply_nodes (loc, node_callback_clear, ctx);
+			return;
+		}
 	}
 
-	struct node_callback_leaf_ctx* visit = ctx;
-	visit->callback (loc.start, entry, visit->ctx);
+	physical_t phys = *entry & MMU_REG_PHYS_ADDRESS_MASK;
+	*entry = 0;
+	tlb_invalidate (tlb, loc.start);
+	if (tlb->pmm)
+		free_leaf (tlb, phys, depth);
 }
 
-struct leaf_callback_assign_ctx {
-	physical_t p_base;
-	uintptr_t v_base;
-	page_map_entry_t flags;
+struct node_callback_move_ctx {
+	struct mmu_page_map_part top;
+	uintptr_t offset;
+	struct tlb_batch* tlb;
 };
 
+/* Moves present leaves up by offset (in ctx), keeping their flags. Huge
+ * pages stay huge if the offset keeps them aligned */
 static void
-leaf_callback_assign_linear (
-	uintptr_t virt_addr,
+node_callback_move (
+	struct node_command_loc loc,
 	page_map_entry_t* entry,
 	void* ctx
 ){
-	struct leaf_callback_assign_ctx* data = ctx;
-	physical_t addr = virt_addr - data->v_base + data->p_base;
-	*entry = addr | data->flags;
-}
+	struct node_callback_move_ctx* move = ctx;
+	const int depth = loc.page.depth - 1;
 
-static void
-leaf_callback_clear (
-	uintptr_t virt_addr,
-	page_map_entry_t* entry,
-	void* ctx
-){
+	if (!(*entry & MMU_REG_PRESENT))
+		return;
+
+	if (loc.page.depth <= PAGE_MAP_DEPTH_BOTTOM) {
+		const uintptr_t size = entry_size (depth);
+		if (!is_huge (*entry, depth) || loc.end - loc.start < size
+			|| (move->offset & (size - 1)))
+		{
+			if (is_huge (*entry, depth))
+				split_huge (entry, depth, loc.start, move->tlb);
+
+			loc.page.page = *entry & MMU_REG_PHYS_ADDRESS_MASK;
+			apply_nodes (loc, node_callback_move, ctx);
+			return;
+		}
+	}
+
+	page_map_entry_t* to = walk_create (move->top, loc.start + move->offset,
+										depth, move->tlb);
+
+	page_map_entry_t old = *to;
+	*to = *entry;
 	*entry = 0;
+	tlb_invalidate (move->tlb, loc.start);
+
+	// Tables left over where a huge page goes
+	if ((old & MMU_REG_PRESENT) && depth < PAGE_MAP_DEPTH_BOTTOM
+		&& !is_huge (old, depth))
+		free_tables ((struct mmu_page_map_part) {
+			.page = old & MMU_REG_PHYS_ADDRESS_MASK,
+			.depth = depth + 1,
+		}, move->tlb);
+	else if (old & MMU_REG_PRESENT)
+		tlb_invalidate (move->tlb, loc.start + move->offset);
 }
 
 /* Second part - Public Api. Shoudn't be much logic here */
@@ -281,19 +569,16 @@ mmu_assign (
 		.end = (uintptr_t)address + size,
 	};
 
-	struct leaf_callback_assign_ctx leaves ={
+	struct tlb_batch tlb = {};
+	struct node_callback_assign_ctx assign = {
 		.flags = convert_flags (flags),
 		.p_base = page,
 		.v_base = (uintptr_t)address,
+		.tlb = &tlb,
 	};
 
-	struct node_callback_leaf_ctx nodes = {
-		.callback = leaf_callback_assign_linear,
-		.ctx = &leaves,
-	};
-
-	apply_nodes_entry (loc, node_callback_reserve, NULL);
-	apply_nodes_entry (loc, node_callback_leaf, &nodes);
+	apply_nodes_entry (loc, node_callback_assign, &assign);
+	tlb_flush (&tlb);
 }
 
 void
@@ -319,12 +604,64 @@ mmu_remove (
 		.end = (uintptr_t)address + size,
 	};
 
-	struct node_callback_leaf_ctx nodes = {
-		.callback = leaf_callback_clear,
+	struct tlb_batch tlb = {};
+
+	apply_nodes_entry (loc, node_callback_clear, &tlb);
+	apply_nodes_entry (loc, node_callback_gc, &tlb);
+	tlb_flush (&tlb);
+}
+
+void
+mmu_remove_free (
+	struct mmu_page_map_part top,
+	void* address,
+	size_t size,
+	struct pmm* pmm
+){
+	struct node_command_loc loc = {
+		.page = top,
+		.start = (uintptr_t)address,
+		.end = (uintptr_t)address + size,
+	};
+
+	struct tlb_batch tlb = { .pmm = pmm };
+
+	apply_nodes_entry (loc, node_callback_clear, &tlb);
+	apply_nodes_entry (loc, node_callback_gc, &tlb);
+	tlb_flush (&tlb);
+}
+
+void
+mmu_move (
+	struct mmu_page_map_part top,
+	void* from,
+	void* to,
+	size_t size
+){
+	struct node_command_loc loc = {
+		.page = top,
+		.start = (uintptr_t)from,
+		.end = (uintptr_t)from + size,
+	};
+
+	if (loc.page.page == 0)
+		loc.page = get_current_page_map_top();
+
+	struct tlb_batch tlb = {};
+	struct node_callback_move_ctx move = {
+		.top = loc.page,
+		.offset = (uintptr_t)to - (uintptr_t)from,
+		.tlb = &tlb,
 	};
 
-	apply_nodes_entry (loc, node_callback_leaf, &nodes);
-	apply_nodes_entry (loc, node_callback_gc, NULL);
+	require_page_aligned (to);
+	assert (mmu_is_canonical_address ((uintptr_t)to)
+		&& mmu_is_canonical_address ((uintptr_t)to + size - 1),
+		"Non-canonical address");
+
+	apply_nodes_entry (loc, node_callback_move, &move);
+	apply_nodes_entry (loc, node_callback_gc, &tlb);
+	tlb_flush (&tlb);
 }
 
 void
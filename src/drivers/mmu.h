@@ -72,7 +72,8 @@ void mmu_initialise (struct pmm* pmm);
 
 /*
  * Assign/unassign a virtual address to a physical range.
- * This is currently a simple implementation, only using minimal size pages.
+ * Parts of the range aligned (virtually and physically) to 2M or 1G are
+ * mapped with huge pages. Removing part of a huge page splits it first.
  */
 void mmu_assign (struct mmu_page_map_part top,
 		 enum mmu_flags flags,
@@ -84,6 +85,26 @@ void mmu_remove (struct mmu_page_map_part top,
 		 void* address,
 		 size_t size);
 
+/*
+ * As mmu_remove, and also frees the pages that were mapped to pmm.
+ * Unmapped parts of the range are skipped quickly, so this suits large,
+ * sparsely filled ranges (e.g. ones filled on demand by page faults)
+ */
+void mmu_remove_free (struct mmu_page_map_part top,
+		      void* address,
+		      size_t size,
+		      struct pmm* pmm);
+
+/*
+ * Move the pages mapped in [from, from + size) to [to, to + size), keeping
+ * their flags. Unmapped parts of the range stay unmapped. The ranges must
+ * not overlap. Costs O(pages mapped), however big they are
+ */
+void mmu_move (struct mmu_page_map_part top,
+	       void* from,
+	       void* to,
+	       size_t size);
+
 /*
  * Slightly more efficient versions for the (relatively common) case
  * of assigning/removing a single page, i.e. the above functions
@@ -8,8 +8,10 @@
 #include "libk/kstdio.h"
 #include "drivers/mmu_reg.h"
 #include "drivers/mmu.h"
+#include "drivers/cpu.h"
 
 #include "macros.h"
+#include "panic.h"
 
 void _hcf(void);
 void kernel_main(void);
@@ -89,23 +91,6 @@ struct limine_kernel_file_request kfdinfo = {
 	.id = LIMINE_KERNEL_FILE_REQUEST,
 };
 
-struct RSDPDescriptor {
- char Signature[8];
- uint8_t Checksum;
- char OEMID[6];
- uint8_t Revision;
- uint32_t RsdtAddress;
-} __attribute__ ((packed));
-
-struct RSDPDescriptor20 {
- struct RSDPDescriptor firstPart;
-
- uint32_t Length;
- uint64_t XsdtAddress;
- uint8_t ExtendedChecksum;
- uint8_t reserved[3];
-} __attribute__ ((packed));
-
 const char* limine_mmap_typename[] = {
 	"Usable",
 	"Reserved",
@@ -122,6 +107,76 @@ const char* limine_mmap_typename[] = {
 static raw_page rwpmmpg;
 static struct pmm* pmm = (void*)&rwpmmpg;
 
+#include "drivers/acpi.h"
+
+#define NUMA_RANGES_MAX 64
+
+static struct acpi_memory_affinity numa_ranges[NUMA_RANGES_MAX];
+static int numa_range_count;
+
+/* Read the NUMA layout from the SRAT and SLIT, and pass distances on to pmm */
+static void
+scan_acpi (struct pmm* pmm)
+{
+	if (!acpi_initialise (rsdpinfo.response->address)) {
+		printf ("ACPI: no valid RSDP\n");
+		return;
+	}
+
+	numa_range_count = acpi_srat_memory (numa_ranges, NUMA_RANGES_MAX);
+	int localities = acpi_slit_localities ();
+
+	printf ("ACPI: SRAT memory ranges: %d SLIT localities: %d\n",
+			numa_range_count, localities);
+
+	for ( int i=0; i<numa_range_count; i++ ) {
+		struct acpi_memory_affinity* range = &numa_ranges[i];
+		printf ("\t%016zx+%16zx : domain %u\n",
+				range->base, range->length, range->domain);
+
+		if (range->domain >= PMM_NODES) {
+			eprintf ("Warning: domain %u treated as node 0 (%s)\n",
+					 range->domain, "too many nodes");
+			range->domain = 0;
+		}
+	}
+
+	localities = MIN (localities, PMM_NODES);
+	for ( int i=0; i<localities; i++ ) {
+		for ( int j=0; j<localities; j++ )
+			pmm_set_node_distance (pmm, i, j, acpi_slit_distance (i, j));
+	}
+}
+
+/* Add usable memory to pmm, split where SRAT ranges begin and end so each
+ * piece is tagged with its node. Memory outside the SRAT is node 0 */
+static void
+add_memory (struct pmm* pmm, physical_t base, size_t length)
+{
+	const physical_t end = base + length;
+
+	while (base < end) {
+		physical_t next = end;
+		int node = 0;
+
+		for ( int i=0; i<numa_range_count; i++ ) {
+			physical_t r_base = numa_ranges[i].base;
+			physical_t r_end = r_base + numa_ranges[i].length;
+
+			if (r_base <= base && base < r_end)
+				node = numa_ranges[i].domain;
+			if (r_base > base)
+				next = MIN (next, r_base);
+			if (r_end > base)
+				next = MIN (next, r_end);
+		}
+
+		next = MIN (ROUND_UP_P2 (next, PAGE_SIZE), end);
+		pmm_add_node (pmm, base, next - base, node);
+		base = next;
+	}
+}
+
 static void
 print_meminfo()
 {
@@ -139,6 +194,7 @@ print_meminfo()
 	size_t largest_size = 0;
 
 	struct pmm* pmm = pmm_new (&rwpmmpg);
+	scan_acpi (pmm);
 
 	for ( int i=0; i<entries; i++ ) {
 		struct limine_memmap_entry* mem = mmapinfo.response->entries[i];
@@ -152,7 +208,7 @@ print_meminfo()
 				largest_size = mem->length;
 				largest_addr = mem->base;
 			}
-			pmm_add (pmm, mem->base, mem->length);
+			add_memory (pmm, mem->base, mem->length);
 		}
 
 		if (mem->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE)
@@ -167,6 +223,9 @@ print_meminfo()
 
 	printf ("\tPMM total: %zu free: %zu used: %zu overhead: %zu\n",
 			stat.total, stat.free, stat.used, stat.overhead);
+
+	// Reclaim from 1/64 of memory free, until 1/32 is
+	pmm_set_watermarks (pmm, stat.total / 64, stat.total / 32);
 }
 
 static void
@@ -216,11 +275,6 @@ REG_READ(cr8)
 
 uint64_t global_hhdm_offset;
 
-static void
-scan_acpi (uint64_t rsdt)
-{
-}
-
 static void
 print_limine_info ()
 {
@@ -328,6 +382,91 @@ test_vaddr()
 	vaddress_print (vaddr);
 	vaddress_free (vaddr, 0, 0x5000);
 	vaddress_print (vaddr);
+
+	p = vaddress_allocate_aligned (vaddr, 0x100, 0x1000);
+	assert (p && (uintptr_t)p % 0x1000 == 0, "Misaligned vaddr allocation");
+	vaddress_print (vaddr);
+	vaddress_free (vaddr, p, 0x100);
+
+	// Aligned requests above the split, small ones below
+	vaddress_space_split (vaddr, (void*)0x3000, 0x1000);
+	p = vaddress_allocate_aligned (vaddr, 0x100, 0x1000);
+	q = vaddress_allocate (vaddr, 0x100);
+	assert (p >= (void*)0x3000 && q < (void*)0x3000, "Vaddr split ignored");
+	vaddress_print (vaddr);
+	vaddress_free (vaddr, p, 0x100);
+	vaddress_free (vaddr, q, 0x100);
+
+	vaddress_space_free (vaddr);
+}
+
+#include "drivers/interrupt.h"
+static bool
+kernel_page_fault (void* address, bool is_write, void* context)
+{
+	return vaddress_fault (context, address, is_write);
+}
+
+static void
+test_demand_fault ()
+{
+	// Lower half is unmapped after clear_map_lower_half
+	char* begin = (void*)0x4000000000ULL;
+	struct vaddress_space* vaddr = vaddress_space_new (pmm, begin,
+													   begin + (1ULL << 32));
+	interrupt_set_page_fault_handler (kernel_page_fault, vaddr);
+
+	size_t size = 1ULL << 30;
+	size_t free_before = pmm_count_pages (pmm).free;
+	char* p = vaddress_reserve (vaddr, size, 0, MEMORY_WRITE,
+								VADDRESS_BACKING_ZERO);
+	assert (p, "Reserve failed");
+
+	for (size_t off = 0; off < size; off += size / 8) {
+		assert (p[off] == 0, "Demand page not zeroed");
+		p[off + 1] = 1;
+	}
+
+	size_t free_touched = pmm_count_pages (pmm).free;
+	printf ("Reserved %zu MiB, touching 8 pages used %zu pages\n",
+			size >> 20, free_before - free_touched);
+
+	vaddress_free (vaddr, p, size);
+
+	// Erasing regions moves nodes around, backings must stay with them
+	char* region[16];
+	for (int i=0; i<16; i++) {
+		region[i] = vaddress_reserve (vaddr, PAGE_SIZE, 0, MEMORY_WRITE,
+									  i % 2 ? VADDRESS_BACKING_ZERO
+											: VADDRESS_BACKING_NONE);
+		assert (region[i], "Reserve failed");
+	}
+	for (int i=0; i<16; i+=2)
+		vaddress_free (vaddr, region[i], PAGE_SIZE);
+	for (int i=1; i<16; i+=2)
+		region[i][0] = 1;
+	vaddress_print (vaddr);
+	for (int i=1; i<16; i+=2)
+		vaddress_free (vaddr, region[i], PAGE_SIZE);
+
+	interrupt_set_page_fault_handler (NULL, NULL);
+	vaddress_space_free (vaddr);
+}
+
+/* A shared page lives until its last reference is dropped */
+static void
+test_page_refs ()
+{
+	physical_t page = pmm_allocate_page (pmm);
+	assert (page, "Allocation failed");
+
+	pmm_page (pmm, page)->owner = pmm;
+	page_get (pmm, page);
+	assert (pmm_page (pmm, page)->refcount == 1, "Reference not counted");
+
+	assert (!page_put (pmm, page), "Page freed with a reference left");
+	assert (page_put (pmm, page), "Last reference did not free the page");
+	assert (pmm_page (pmm, page)->owner == NULL, "Owner not cleared");
 }
 
 #include "memory/arena_allocator.h"
@@ -342,6 +481,14 @@ test_arena ()
 		printf ("Alloc %p + %zu\n", blk.ptr, blk.size);
 	}
 
+	struct arena_mark mark = arena_mark (arena);
+	struct blk first = kalloc (arena, 3 * PAGE_SIZE);
+	printf ("Alloc %p + %zu\n", first.ptr, first.size);
+	arena_rewind (arena, mark);
+
+	struct blk again = kalloc (arena, 3 * PAGE_SIZE);
+	assert (again.ptr == first.ptr, "Arena rewind did not reuse memory");
+
 	DELETE_IFACE (arena);
 }
 
@@ -351,6 +498,25 @@ print_pmm_stats ()
 	struct pmm_stat stat = pmm_count_pages (pmm);
 	printf ("PMM total: %zu free: %zu used: %zu overhead: %zu\n",
 			stat.total, stat.free, stat.used, stat.overhead);
+
+	printf ("\tfree runs by order:");
+	for (int i=0; i<=PMM_MAX_ORDER; i++)
+		printf (" %zu", stat.free_order[i]);
+	putchar ('\n');
+
+	printf ("\tcpu cache: %zu pages, hit %zu miss %zu refill %zu drain %zu\n",
+			stat.cached, stat.magazine_hits, stat.magazine_misses,
+			stat.magazine_refills, stat.magazine_drains);
+	printf ("\tzeroed: %zu pages\n", stat.zeroed);
+	printf ("\treclaimed: %zu pages%s\n", stat.reclaimed,
+			stat.reclaim_wanted ? " (memory low)" : "");
+
+	if (numa_range_count) {
+		printf ("\tfree by node:");
+		for (int i=0; i<PMM_NODES; i++)
+			printf (" %zu", stat.free_node[i]);
+		putchar ('\n');
+	}
 }
 
 static void
@@ -377,6 +543,384 @@ test_mmu ()
 	pmm_free_page (pmm, page);
 }
 
+static inline uint64_t
+read_tsc ()
+{
+	uint32_t lo, hi;
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* Page allocation latency at increasing memory occupancy.
+ * Held pages are chained through their first word, so this needs no
+ * storage of its own */
+static void
+bench_pmm ()
+{
+	static const int occupancy[] = { 10, 50, 90, 99 };
+	enum { BATCH = 64, ROUNDS = 64 };
+
+	struct pmm_stat stat = pmm_count_pages (pmm);
+	physical_t held = 0;
+	size_t held_count = 0;
+
+	printf ("PMM allocation latency (%zu free pages)\n", stat.free);
+
+	for (size_t o=0; o<ARRAY_LENGTH(occupancy); o++) {
+		size_t target = stat.free * occupancy[o] / 100;
+		for ( ; held_count < target; held_count++) {
+			physical_t page = pmm_allocate_page (pmm);
+			if (page == 0)
+				break;
+			*(physical_t*)HHDM_POINTER (page) = held;
+			held = page;
+		}
+
+		// Caches and overhead aren't counted exactly, the top may not fit
+		if (held_count < target) {
+			printf ("	%3i%% used: out of memory at %zu pages\n",
+					occupancy[o], held_count);
+			break;
+		}
+
+		physical_t batch[BATCH];
+		uint64_t cycles = 0;
+		uint64_t batch_cycles = 0;
+		for (int r=0; r<ROUNDS; r++) {
+			uint64_t start = read_tsc ();
+			for (int i=0; i<BATCH; i++)
+				batch[i] = pmm_allocate_page (pmm);
+			cycles += read_tsc () - start;
+
+			for (int i=0; i<BATCH; i++)
+				pmm_free_page (pmm, batch[i]);
+
+			start = read_tsc ();
+			size_t got = pmm_allocate_page_batch (pmm, batch, BATCH);
+			batch_cycles += read_tsc () - start;
+
+			pmm_free_pages (pmm, batch, got);
+		}
+
+		printf ("\t%3i%% used: %lu cycles/page, %lu batched\n",
+				occupancy[o], cycles / (BATCH * ROUNDS),
+				batch_cycles / (BATCH * ROUNDS));
+	}
+
+	while (held) {
+		physical_t next = *(physical_t*)HHDM_POINTER (held);
+		pmm_free_page (pmm, held);
+		held = next;
+	}
+}
+
+/* Churn of mixed allocations for one CPU. Every held page is stamped with
+ * its owner and position, and checked before it is freed, so pages handed
+ * to two CPUs at once show up as corruption. Returns pages allocated */
+static size_t
+stress_pmm_cpu (int cpu, int rounds)
+{
+	enum { HOLD = 512 };
+	physical_t held[HOLD];
+	size_t allocated = 0;
+
+	for (int r=0; r<rounds; r++) {
+		int n = 0;
+		for ( ; n<HOLD; n++) {
+			physical_t page;
+			if (n % 16 == 0) {
+				// Exercise runs, then keep a single page of the slot
+				page = pmm_allocate_pages (pmm, 2);
+				pmm_free_pages_order (pmm, page, 2);
+				page = pmm_allocate_page (pmm);
+			} else if (n % 16 == 1) {
+				page = pmm_allocate_page_node (pmm, cpu % PMM_NODES);
+			} else {
+				page = pmm_allocate_page (pmm);
+			}
+
+			if (page == 0)
+				break;
+			*(uint64_t*)HHDM_POINTER (page) = ((uint64_t)cpu << 32) | n;
+			held[n] = page;
+		}
+
+		for (int i=0; i<n; i++) {
+			uint64_t stamp = *(uint64_t*)HHDM_POINTER (held[i]);
+			if (stamp != (((uint64_t)cpu << 32) | i))
+				panic ("PMM stress: page %zx stamp %lx, expected cpu %i slot %i\n",
+					   held[i], stamp, cpu, i);
+		}
+
+		// Alternate single and batched frees
+		if (r % 2) {
+			pmm_free_pages (pmm, held, n);
+		} else {
+			for (int i=0; i<n; i++)
+				pmm_free_page (pmm, held[i]);
+		}
+
+		allocated += n;
+	}
+
+	pmm_flush_cpu_cache (pmm);
+	return allocated;
+}
+
+/* Allocator stress and throughput. stress_pmm_cpu is the body each CPU
+ * runs at once, but until the APs are started only the BSP takes part.
+ * Free memory must be the same before and after */
+static void
+bench_pmm_stress ()
+{
+	enum { ROUNDS = 64 };
+
+	pmm_flush_cpu_cache (pmm);
+	struct pmm_stat before = pmm_count_pages (pmm);
+
+	uint64_t start = read_tsc ();
+	size_t pages = stress_pmm_cpu (cpu_current_index (), ROUNDS);
+	uint64_t cycles = read_tsc () - start;
+
+	struct pmm_stat after = pmm_count_pages (pmm);
+	if (after.free != before.free)
+		panic ("PMM stress: %zu pages free before, %zu after\n",
+			   before.free, after.free);
+
+	printf ("PMM stress: %zu pages, %lu cycles/page (1 cpu)\n",
+			pages, cycles / MAX (pages, 1));
+}
+
+/* First fit against 100k regions: allocate 200k pages, then free every
+ * other one, leaving one page holes */
+static void
+bench_vaddr ()
+{
+	enum { REGIONS = 100000, OPS = 1000 };
+	void* begin = (void*)0x100000000000ULL;
+
+	struct vaddress_space* vaddr = vaddress_space_new (pmm, begin,
+													   begin + (1ULL << 40));
+
+	uint64_t start = read_tsc ();
+	for (int i=0; i<2*REGIONS; i++)
+		vaddress_allocate (vaddr, PAGE_SIZE);
+	for (int i=0; i<REGIONS; i++)
+		vaddress_free (vaddr, begin + (2*i + 1) * PAGE_SIZE, PAGE_SIZE);
+	uint64_t setup = read_tsc () - start;
+
+	// Fits the lowest hole, merging two regions
+	start = read_tsc ();
+	for (int i=0; i<OPS; i++) {
+		void* p = vaddress_allocate (vaddr, PAGE_SIZE);
+		vaddress_free (vaddr, p, PAGE_SIZE);
+	}
+	uint64_t hole = read_tsc () - start;
+
+	// Fits no hole, so has to go past every region
+	start = read_tsc ();
+	for (int i=0; i<OPS; i++) {
+		void* p = vaddress_allocate (vaddr, 2 * PAGE_SIZE);
+		vaddress_free (vaddr, p, 2 * PAGE_SIZE);
+	}
+	uint64_t end = read_tsc () - start;
+
+	printf ("vaddr %i regions: setup %lu cycles/op, "
+			"alloc+free %lu (hole) %lu (end) cycles\n",
+			REGIONS, setup / (3 * REGIONS), hole / OPS, end / OPS);
+
+	vaddress_space_free (vaddr);
+}
+
+/* Cycles per page for one read of each page of [buffer, buffer + size),
+ * repeated a few times. Touching one line per page makes it bound by TLB
+ * misses rather than bandwidth */
+static uint64_t
+bench_page_stride (volatile const char* buffer, size_t size)
+{
+	enum { PASSES = 8 };
+	uint64_t start = read_tsc ();
+	for (int pass=0; pass<PASSES; pass++)
+		for (size_t off = 0; off < size; off += PAGE_SIZE)
+			(void)buffer[off];
+	return (read_tsc () - start) / (PASSES * (size / PAGE_SIZE));
+}
+
+/* The same 64 MiB of 2 MiB runs, mapped with 4K pages and with 2M pages */
+static void
+bench_huge_pages ()
+{
+	enum { RUNS = 32 };
+	const size_t run = (size_t)PAGE_SIZE << PMM_MAX_ORDER;
+	char* buffer = (void*)0x5000000000ULL;
+	physical_t pages[RUNS];
+
+	for (int i=0; i<RUNS; i++) {
+		pages[i] = pmm_allocate_pages (pmm, PMM_MAX_ORDER);
+		assert (pages[i], "Out of memory for huge page bench");
+	}
+
+	// One page at a time can't use huge pages
+	for (int i=0; i<RUNS; i++)
+		for (size_t off = 0; off < run; off += PAGE_SIZE)
+			mmu_assign_1 (mmu_top_page, 0, pages[i] + off,
+						  buffer + i * run + off);
+	uint64_t small = bench_page_stride (buffer, RUNS * run);
+	mmu_remove (mmu_top_page, buffer, RUNS * run);
+
+	for (int i=0; i<RUNS; i++)
+		mmu_assign (mmu_top_page, 0, buffer + i * run, run, pages[i]);
+	uint64_t huge = bench_page_stride (buffer, RUNS * run);
+	mmu_remove (mmu_top_page, buffer, RUNS * run);
+
+	printf ("%zu MiB page stride read: 4K pages %lu cycles/page, "
+			"2M pages %lu cycles/page\n", RUNS * run >> 20, small, huge);
+
+	for (int i=0; i<RUNS; i++)
+		pmm_free_pages_order (pmm, pages[i], PMM_MAX_ORDER);
+}
+
+#include "memory/heap.h"
+#include "memory/allocator_static.h"
+#include "memory/pmm_allocator.h"
+#include "memory/profiling_allocator.h"
+// Well above the HHDM, which starts at 0xffff800000000000
+#define KERNEL_HEAP_BEGIN ((void*)0xffffa00000000000ULL)
+#define KERNEL_HEAP_SIZE (1ULL << 36)
+
+static struct kernel_heap kernel_heap;
+static allocator_t kernel_allocator; // The heap, profiled if PROFILE_ALLOC
+
+static inline uint64_t
+xorshift (uint64_t* state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* Random alloc/free churn over a fixed number of slots. Sizes are mostly
+ * small, with one in large_every up to large_max. Returns cycles/op */
+static uint64_t
+bench_allocator_trace (allocator_t alloc, int large_every, size_t large_max)
+{
+	enum { SLOTS = 1024, OPS = 200000 };
+	static struct blk slot[SLOTS];
+	uint64_t rng = 0x2545f4914f6cdd1dULL;
+
+	uint64_t start = read_tsc ();
+	for (int i=0; i<OPS; i++) {
+		uint64_t r = xorshift (&rng);
+		struct blk* b = &slot[r % SLOTS];
+
+		if (b->ptr) {
+			kfree (alloc, *b);
+			*b = (struct blk) {};
+		} else {
+			r >>= 10;
+			size_t size = r % large_every ? 8 + (r >> 8) % 248
+										  : 1 + (r >> 8) % large_max;
+			*b = kalloc (alloc, size);
+		}
+	}
+	uint64_t cycles = read_tsc () - start;
+
+	for (int i=0; i<SLOTS; i++) {
+		kfree (alloc, slot[i]);
+		slot[i] = (struct blk) {};
+	}
+
+	return cycles / OPS;
+}
+
+/* Grow a buffer by doubling from a page up to size. Returns total cycles */
+static uint64_t
+bench_realloc_grow (allocator_t alloc, size_t size)
+{
+	struct blk blk = {};
+
+	uint64_t start = read_tsc ();
+	for (size_t s = PAGE_SIZE; s <= size; s *= 2) {
+		blk = krealloc (alloc, blk, s);
+		assert (blk.ptr, "Realloc failed");
+		((char*)blk.ptr)[s - 1] = 1;
+	}
+	uint64_t cycles = read_tsc () - start;
+
+	kfree (alloc, blk);
+	return cycles;
+}
+
+/* The same alloc/free pairs through the vtable and the inlined fast path */
+static void
+bench_static_dispatch ()
+{
+	enum { OPS = 100000 };
+	allocator_t slab = slab_new (pmm_allocator (pmm), 64, 16);
+	slab_t cache = slab_cache_of (slab);
+
+	uint64_t start = read_tsc ();
+	for (int i=0; i<OPS; i++)
+		kfree (slab, kalloc (slab, 64));
+	uint64_t dynamic = read_tsc () - start;
+
+	start = read_tsc ();
+	for (int i=0; i<OPS; i++)
+		kfree_static (cache, kalloc_static (cache, 64));
+	uint64_t inlined = read_tsc () - start;
+
+	printf ("slab alloc+free: vtable %lu cycles, static %lu cycles\n",
+			dynamic / OPS, inlined / OPS);
+	DELETE_IFACE (slab);
+
+	allocator_t arena = make_arena_pmm_allocator (pmm, 4);
+	arena_t bump = arena_of (arena);
+
+	start = read_tsc ();
+	for (int i=0; i<OPS; i++)
+		kalloc (arena, 32);
+	dynamic = read_tsc () - start;
+
+	start = read_tsc ();
+	for (int i=0; i<OPS; i++)
+		kalloc_static (bump, 32);
+	inlined = read_tsc () - start;
+
+	printf ("arena alloc: vtable %lu cycles, static %lu cycles\n",
+			dynamic / OPS, inlined / OPS);
+	DELETE_IFACE (arena);
+}
+
+static void
+bench_heap ()
+{
+	allocator_t heap = kernel_allocator;
+	allocator_t arena = make_arena_pmm_allocator (pmm, 4);
+
+	printf ("heap mixed trace: %lu cycles/op, arena: %lu cycles/op\n",
+			bench_allocator_trace (heap, 16, PAGE_SIZE - 1),
+			bench_allocator_trace (arena, 16, PAGE_SIZE - 1));
+	printf ("heap trace with large objects: %lu cycles/op\n",
+			bench_allocator_trace (heap, 64, 64 * PAGE_SIZE));
+
+	// Sizes below 256 only, so they all fit one slab object
+	allocator_t slab = slab_new (pmm_allocator (pmm), 256, 16);
+	printf ("small objects: heap %lu cycles/op, slab %lu cycles/op\n",
+			bench_allocator_trace (heap, INT_MAX, 1),
+			bench_allocator_trace (slab, INT_MAX, 1));
+
+	DELETE_IFACE (slab);
+	DELETE_IFACE (arena);
+
+	// The arena has no realloc, so it copies each time
+	arena = make_arena_pmm_allocator (pmm, 4);
+	printf ("realloc growth to 1 MiB: heap %lu cycles, arena %lu cycles\n",
+			bench_realloc_grow (heap, 1 << 20),
+			bench_realloc_grow (arena, 1 << 20));
+	DELETE_IFACE (arena);
+}
+
 static void
 test_exe ()
 {
@@ -413,6 +957,7 @@ kernel_main(void)
 
 	bool use_serial = strstr (kfdinfo.response->kernel_file->cmdline, "serial");
 	bool do_fractal = strstr (kfdinfo.response->kernel_file->cmdline, "fractal");
+	bool do_bench = strstr (kfdinfo.response->kernel_file->cmdline, "bench");
 
 	struct framebuffer_config fb = {
 		.address = fbinfo.response->framebuffers[0]->address,
@@ -442,14 +987,38 @@ kernel_main(void)
 	clear_map_lower_half ();
 
 	mmu_initialise (pmm);
+	interrupt_initialise ();
+	heap_initialise (&kernel_heap, pmm, KERNEL_HEAP_BEGIN,
+					 KERNEL_HEAP_BEGIN + KERNEL_HEAP_SIZE);
+	kernel_allocator = profiling_allocator_new (heap_allocator (&kernel_heap));
 	for (int i=0; i<2; i++)
 		test_mmu ();
+	test_vaddr ();
+	test_arena ();
+	test_demand_fault ();
+	test_page_refs ();
 	for (int i=0; i<2; i++)
 		test_exe ();
 	print_pmm_stats ();
 
+	if (do_bench) {
+		bench_pmm ();
+		bench_pmm_stress ();
+		bench_vaddr ();
+		bench_huge_pages ();
+		bench_heap ();
+		profiling_allocator_report (kernel_allocator);
+		bench_static_dispatch ();
+	}
+
 	if (do_fractal)
 		framebuffer_dofractals (fb);
 
+	// Nothing else to do yet, so idle time goes to reclaim (if memory is
+	// low) and the zeroed page pool
+	pmm_reclaim (pmm, SIZE_MAX);
+	pmm_refill_zeroed (pmm, PMM_ZEROED_TARGET);
+	print_pmm_stats ();
+
 	printf ("=== SYSTEM SHUTDOWN ===\n");
 }
@@ -4,3 +4,7 @@
 #include <string.h>
 
 size_t strnlen (const char* str, size_t n);
+
+/* Zero a whole 4K page. May bypass the cache, for pages that are not about
+ * to be used (e.g. filling a pool of clean pages) */
+void clear_page (void* page);
@@ -1,4 +1,5 @@
 #include "kstring.h"
+#include "page.h"
 
 #define WEAK __attribute__((weak))
 
@@ -45,6 +46,18 @@ memcpy (void* restrict dst, const void* restrict src, size_t count)
 	return dst;
 }
 
+WEAK int
+memcmp (const void* lhs, const void* rhs, size_t count)
+{
+	const unsigned char* l = lhs;
+	const unsigned char* r = rhs;
+	for ( size_t i=0; i<count; i++ ) {
+		if (l[i] != r[i])
+			return l[i] - r[i];
+	}
+	return 0;
+}
+
 WEAK void*
 memset (void* dst, int ch, size_t count)
 {
@@ -73,3 +86,9 @@ memmove (void* dst, const void* src, size_t count)
 	memcpy (d + offset, s + offset, overlap);
 	return memcpy (d, s, offset);
 }
+
+WEAK void
+clear_page (void* page)
+{
+	memset (page, 0, PAGE_SIZE);
+}
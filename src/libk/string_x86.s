@@ -53,3 +53,23 @@ strlen:
 	jmp	.L.strlen
 
 	.size	strlen, .-strlen
+
+
+	.global clear_page
+	.type clear_page, @function
+
+clear_page:
+	xor	eax, eax		# val
+	mov	ecx, 4096 / 32		# 4 stores per loop
+.L.clear_page:
+	movnti	[rdi], rax		# non-temporal, skip the cache
+	movnti	[rdi + 8], rax
+	movnti	[rdi + 16], rax
+	movnti	[rdi + 24], rax
+	add	rdi, 32
+	dec	ecx
+	jnz	.L.clear_page
+	sfence				# order against later stores
+	ret
+
+	.size	clear_page, .-clear_page
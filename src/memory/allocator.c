@@ -1,7 +1,18 @@
 #include "allocator.h"
+#include "types.h"
 #include "macros.h"
 #include "panic.h"
 #include "libk/kstring.h"
+#include "profiling_allocator.h"
+
+#if PROFILE_ALLOC
+void* allocator_call_site[CPU_MAX];
+
+#define NOTE_CALL_SITE() \
+	(allocator_call_site[cpu_current_index ()] = __builtin_return_address (0))
+#else
+#define NOTE_CALL_SITE() ((void)0)
+#endif
 
 static struct blk
 doalloc (allocator_t alloc, size_t size)
@@ -20,6 +31,8 @@ dofree (allocator_t alloc, struct blk blk)
 struct blk
 kalloc (allocator_t alloc, size_t size)
 {
+	NOTE_CALL_SITE ();
+
 	if (size == 0)
 		return (struct blk) {};
 
@@ -29,8 +42,11 @@ kalloc (allocator_t alloc, size_t size)
 struct blk
 krealloc (allocator_t alloc, struct blk mem, size_t size)
 {
+	NOTE_CALL_SITE ();
+
 	if (size == 0) {
-		kfree (alloc, mem);
+		if (mem.ptr)
+			dofree (alloc, mem);
 		return (struct blk) {};
 	}
 
@@ -44,7 +60,7 @@ krealloc (allocator_t alloc, struct blk mem, size_t size)
 	if (blk.ptr == 0)
 		return (struct blk) {};
 
-	memcpy (blk.ptr, mem.ptr, mem.size);
+	memcpy (blk.ptr, mem.ptr, MIN (mem.size, blk.size));
 	dofree (alloc, mem);
 
 	return blk;
@@ -53,6 +69,85 @@ krealloc (allocator_t alloc, struct blk mem, size_t size)
 void
 kfree (allocator_t alloc, struct blk mem)
 {
+	NOTE_CALL_SITE ();
+
 	if (mem.ptr)
 		dofree (alloc, mem);
 }
+
+size_t
+kalloc_batch (allocator_t alloc, size_t size, struct blk* mem, size_t count)
+{
+	NOTE_CALL_SITE ();
+
+	if (size == 0) {
+		for (size_t i=0; i<count; i++)
+			mem[i] = (struct blk) {};
+		return count;
+	}
+
+	if (alloc.vtbl->alloc_batch)
+		return alloc.vtbl->alloc_batch (alloc.self, size, mem, count);
+
+	size_t n = 0;
+	for ( ; n < count; n++) {
+		struct blk blk = doalloc (alloc, size);
+		if (blk.ptr == 0)
+			break;
+		mem[n] = blk;
+	}
+	return n;
+}
+
+void
+kfree_batch (allocator_t alloc, struct blk* mem, size_t count)
+{
+	NOTE_CALL_SITE ();
+
+	if (alloc.vtbl->free_batch) {
+		alloc.vtbl->free_batch (alloc.self, mem, count);
+		return;
+	}
+
+	for (size_t i=0; i<count; i++)
+		if (mem[i].ptr)
+			dofree (alloc, mem[i]);
+}
+
+static inline bool
+is_aligned (struct blk blk, size_t align)
+{
+	return ((uintptr_t)blk.ptr & (align - 1)) == 0;
+}
+
+struct blk
+kalloc_aligned (allocator_t alloc, size_t size, size_t align)
+{
+	NOTE_CALL_SITE ();
+
+	assert (align && (align & (align - 1)) == 0,
+			"Alignment must be a power of two");
+
+	if (size == 0)
+		return (struct blk) {};
+
+	if (alloc.vtbl->alloc_aligned)
+		return alloc.vtbl->alloc_aligned (alloc.self, size, align);
+
+	struct blk blk = doalloc (alloc, size);
+	if (blk.ptr == 0 || is_aligned (blk, align))
+		return blk;
+	dofree (alloc, blk);
+
+	// Blocks of a power of two size are often aligned to it
+	size_t p2 = align;
+	while (p2 < size)
+		p2 *= 2;
+
+	blk = doalloc (alloc, p2);
+	if (blk.ptr == 0 || is_aligned (blk, align))
+		return blk;
+	dofree (alloc, blk);
+
+	return (struct blk) {};
+}
@@ -25,6 +25,10 @@
  *    memcpy is provided if vtbl->realloc == NULL. Only implement this if
  *    reallocation can be done efficiently (e.g. virtual address reassignment).
  *
+ *  - Likewise alloc_batch/free_batch fall back to one call per block, and
+ *    alloc_aligned to trying alloc for a block that happens to be aligned.
+ *    free_batch must skip null blocks.
+ *
  *  - Arenas can set vtbl->free == NULL so frees never occur
  *
  *  - 'Edge cases' are already handled by wrappers sensibly:
@@ -46,12 +50,25 @@ struct blk kalloc   (allocator_t, size_t size);
 struct blk krealloc (allocator_t, struct blk mem, size_t size);
 void       kfree    (allocator_t, struct blk mem);
 
+/* Allocate count blocks of size bytes into mem, returns how many succeeded
+ * (those come first, the rest of mem is untouched) */
+size_t     kalloc_batch (allocator_t, size_t size, struct blk* mem, size_t count);
+void       kfree_batch  (allocator_t, struct blk* mem, size_t count);
+
+/* Allocate size bytes aligned to align (a power of two). Allocators without
+ * alloc_aligned can fail here even if kalloc would succeed */
+struct blk kalloc_aligned (allocator_t, size_t size, size_t align);
+
 /* Allocator Implementation */
 struct allocator_vtbl {
 	struct blk (*alloc)   (void* self, size_t);
 	struct blk (*realloc) (void* self, struct blk, size_t);
 	void       (*free)    (void* self, struct blk);
 	void       (*del)     (void* self);
+
+	size_t     (*alloc_batch)   (void* self, size_t, struct blk*, size_t);
+	void       (*free_batch)    (void* self, struct blk*, size_t);
+	struct blk (*alloc_aligned) (void* self, size_t, size_t align);
 };
 
 typedef struct allocator {
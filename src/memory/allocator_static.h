@@ -0,0 +1,23 @@
+#pragma once
+/*
+ * Allocation through a statically known allocator.
+ *
+ * kalloc_static/kfree_static take either a type-erased allocator_t, and
+ * go through its vtable like kalloc/kfree, or a concrete allocator handle
+ * (arena_t, slab_t), whose fast path is then inlined. Hot code can switch
+ * between the two by changing the type of the variable it holds.
+ */
+
+#include "allocator.h"
+#include "arena_allocator.h"
+#include "slab.h"
+
+#define kalloc_static(a, size) _Generic ((a),	\
+	arena_t: arena_alloc,						\
+	slab_t: slab_cache_alloc,					\
+	allocator_t: kalloc) ((a), (size))
+
+#define kfree_static(a, mem) _Generic ((a),		\
+	arena_t: arena_free,						\
+	slab_t: slab_cache_free,					\
+	allocator_t: kfree) ((a), (mem))
@@ -2,27 +2,18 @@
 #include "allocator.h"
 #include "page.h"
 #include "pmm.h"
+#include "panic.h"
+#include "macros.h"
 
-struct arena_pmm_page_header {
-	struct arena_pmm_page_header* next;
-};
-
-struct arena_pmm {
-	struct arena_pmm_page_header hdr;
-	struct arena_pmm_page_header* current_page;
-	int current_offset;
-	int p2align;
-	pmm_t pmm;
-};
+/* Memory comes in chunks, physically contiguous runs of 2^order pages.
+ * Chunks are linked in the order they were allocated, starting with the
+ * page holding the arena itself. Each new chunk is twice the size of the
+ * last, up to ARENA_MAX_ORDER, so long-lived arenas take few PMM calls.
+ * Allocations too big for a regular chunk get a chunk of their own. */
+#define ARENA_MAX_ORDER 4
 
 static const struct allocator_vtbl arena_pmm_vtbl;
 
-static inline unsigned
-align_p2 (unsigned val, int p2)
-{
-	return (val + (1U<<p2) - 1) >> p2 << p2;
-}
-
 allocator_t
 make_arena_pmm_allocator (pmm_t pmm, int p2align)
 {
@@ -34,7 +25,9 @@ make_arena_pmm_allocator (pmm_t pmm, int p2align)
 	struct arena_pmm* arena = HHDM_POINTER (page);
 	*arena = (struct arena_pmm) {
 		.current_page = &arena->hdr,
-		.current_offset = align_p2 (sizeof(*arena), p2align),
+		.last_page = &arena->hdr,
+		.current_offset = arena_align_p2 (sizeof(*arena), p2align),
+		.grow_order = 1,
 		.p2align = p2align,
 		.pmm = pmm,
 	};
@@ -45,33 +38,184 @@ make_arena_pmm_allocator (pmm_t pmm, int p2align)
 	};
 }
 
+/* Get a chunk of 2^order pages, or smaller if no run that long is free,
+ * down to min_order. Added to the end of the chunk list */
+static struct arena_pmm_page_header*
+arena_pmm_chunk (struct arena_pmm* arena, int order, int min_order)
+{
+	physical_t page = 0;
+	for ( ; order >= min_order && !page; order--)
+		page = order ? pmm_allocate_pages (arena->pmm, order)
+					 : pmm_allocate_page (arena->pmm);
+	if (page == 0)
+		return NULL;
+
+	struct arena_pmm_page_header* hdr = HHDM_POINTER (page);
+	*hdr = (struct arena_pmm_page_header) { .order = order + 1 };
+
+	arena->last_page->next = hdr;
+	arena->last_page = hdr;
+	return hdr;
+}
+
+/* Room for up to *count blocks of size bytes (a multiple of the arena's
+ * alignment) each, starting at a multiple of 2^p2align. *count is cut down
+ * to how many fit, always at least one. Returns NULL if out of memory */
+static void*
+arena_pmm_bump (struct arena_pmm* arena, size_t size, int p2align,
+				size_t* count)
+{
+	size_t offset = arena_align_p2 (arena->current_offset, p2align);
+	size_t end = arena_chunk_size (arena->current_page->order);
+
+	if (offset + size <= end) {
+		*count = MIN (*count, (end - offset) / size);
+		arena->current_offset = offset + *count * size;
+		return (char*)arena->current_page + offset;
+	}
+
+	// Chunks are aligned to their size, so big alignments need big chunks
+	size_t header = arena_align_p2 (sizeof(struct arena_pmm_page_header),
+									p2align);
+
+	int min_order = 0;
+	while (arena_chunk_size (min_order) < header + size
+		   || arena_chunk_size (min_order) < ((size_t)1 << p2align))
+		if (++min_order > PMM_MAX_ORDER)
+			return NULL;
+
+	*count = 1;
+	if (min_order >= ARENA_MAX_ORDER) {
+		// Oversized, so don't give up the rest of the current chunk
+		struct arena_pmm_page_header* hdr =
+			arena_pmm_chunk (arena, min_order, min_order);
+		return hdr ? (char*)hdr + header : NULL;
+	}
+
+	// Out of space, get another chunk
+	int order = MAX (arena->grow_order, min_order);
+	struct arena_pmm_page_header* hdr = arena_pmm_chunk (arena, order, min_order);
+	if (!hdr)
+		return NULL;
+
+	arena->current_page = hdr;
+	arena->current_offset = header + size;
+	if (arena->grow_order < ARENA_MAX_ORDER)
+		arena->grow_order++;
+
+	return (char*)hdr + header;
+}
+
 static struct blk
 arena_pmm_alloc (void* self, size_t size)
 {
 	struct arena_pmm* arena = self;
 
-	size = align_p2 (size, arena->p2align);
-	if (size >= PAGE_SIZE)
-		return (struct blk) {};
+	size = arena_align_p2 (size, arena->p2align);
+	size_t count = 1;
+	void* ptr = arena_pmm_bump (arena, size, arena->p2align, &count);
+
+	return (struct blk) {
+		.ptr = ptr,
+		.size = ptr ? size : 0,
+	};
+}
+
+static struct blk
+arena_pmm_alloc_aligned (void* self, size_t size, size_t align)
+{
+	struct arena_pmm* arena = self;
 
-	if (arena->current_offset + size > PAGE_SIZE) {
-		// Out of space, get another page
-		physical_t page = pmm_allocate_page (arena->pmm);
-		if (page == 0)
-			return (struct blk) {};
+	int p2align = arena->p2align;
+	while (((size_t)1 << p2align) < align)
+		p2align++;
 
-		struct arena_pmm_page_header* hdr = HHDM_POINTER (page);
-		arena->current_page->next = hdr;
-		arena->current_page = hdr;
-		arena->current_offset = align_p2 (sizeof(*hdr), arena->p2align);
+	size = arena_align_p2 (size, arena->p2align);
+	size_t count = 1;
+	void* ptr = arena_pmm_bump (arena, size, p2align, &count);
+
+	return (struct blk) {
+		.ptr = ptr,
+		.size = ptr ? size : 0,
+	};
+}
+
+static size_t
+arena_pmm_alloc_batch (void* self, size_t size, struct blk* mem, size_t count)
+{
+	struct arena_pmm* arena = self;
+
+	size = arena_align_p2 (size, arena->p2align);
+	size_t n = 0;
+
+	while (n < count) {
+		// All the blocks that fit in the chunk come from one bump
+		size_t got = count - n;
+		char* ptr = arena_pmm_bump (arena, size, arena->p2align, &got);
+		if (!ptr)
+			break;
+
+		for (size_t i=0; i<got; i++)
+			mem[n++] = (struct blk) { ptr + i * size, size };
+	}
+	return n;
+}
+
+arena_t
+arena_of (allocator_t alloc)
+{
+	assert (alloc.vtbl == &arena_pmm_vtbl, "Not an arena");
+	return alloc.self;
+}
+
+struct blk
+arena_alloc_slow (arena_t arena, size_t size)
+{
+	if (size == 0)
+		return (struct blk) {};
+	return arena_pmm_alloc (arena, size);
+}
+
+static void
+arena_pmm_free_after (struct arena_pmm* arena,
+					  struct arena_pmm_page_header* page)
+{
+	struct arena_pmm_page_header* next = page->next;
+	page->next = NULL;
+	arena->last_page = page;
+
+	while (next) {
+		page = next;
+		next = page->next;
+		if (page->order)
+			pmm_free_pages_order (arena->pmm, HHDM_PHYSICAL (page), page->order);
+		else
+			pmm_free_page (arena->pmm, HHDM_PHYSICAL (page));
 	}
+}
 
-	struct blk blk = {
-		.ptr = (void*)arena->current_page + arena->current_offset,
-		.size = size,
+struct arena_mark
+arena_mark (allocator_t alloc)
+{
+	assert (alloc.vtbl == &arena_pmm_vtbl, "Not an arena");
+	struct arena_pmm* arena = alloc.self;
+
+	return (struct arena_mark) {
+		.page = arena->current_page,
+		.last_page = arena->last_page,
+		.offset = arena->current_offset,
 	};
-	arena->current_offset += size;
-	return blk;
+}
+
+void
+arena_rewind (allocator_t alloc, struct arena_mark mark)
+{
+	assert (alloc.vtbl == &arena_pmm_vtbl, "Not an arena");
+	struct arena_pmm* arena = alloc.self;
+
+	arena_pmm_free_after (arena, mark.last_page);
+	arena->current_page = mark.page;
+	arena->current_offset = mark.offset;
 }
 
 static void
@@ -79,18 +223,14 @@ arena_pmm_del (void* self)
 {
 	struct arena_pmm* arena = self;
 
-	struct arena_pmm_page_header* page = &arena->hdr;
-	pmm_t pmm = arena->pmm;
-
-	while (page) {
-		physical_t phy = HHDM_PHYSICAL (page);
-		page = page->next;
-		pmm_free_page (pmm, phy);
-	}
+	arena_pmm_free_after (arena, &arena->hdr);
+	pmm_free_page (arena->pmm, HHDM_PHYSICAL (arena));
 }
 
 static const struct allocator_vtbl
 arena_pmm_vtbl = {
 	.alloc = arena_pmm_alloc,
 	.del = arena_pmm_del,
+	.alloc_batch = arena_pmm_alloc_batch,
+	.alloc_aligned = arena_pmm_alloc_aligned,
 };
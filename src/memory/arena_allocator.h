@@ -2,12 +2,94 @@
 /*
  * A basic arena allocator, allocating directly from the physical memory
  * manager, returning HHDM addresses. To be used early, before we have a better
- * allocator set up
+ * allocator set up, or for scratch memory that is dropped all at once.
+ *
+ * Allocations can be up to 2^PMM_MAX_ORDER pages, as they must be
+ * physically contiguous.
  */
 
 #include "allocator.h"
+#include "page.h"
 
 struct pmm; // fwd
 
 allocator_t make_arena_pmm_allocator (struct pmm* pmm, int p2align);
 
+
+/* Position in an arena, to go back to later */
+struct arena_mark {
+	void* page;
+	void* last_page;
+	size_t offset;
+};
+
+/* Remember the current position of an arena */
+struct arena_mark arena_mark (allocator_t arena);
+
+/* Drop everything allocated since mark was taken, keeping the arena.
+ * Marks taken after this one become invalid */
+void arena_rewind (allocator_t arena, struct arena_mark mark);
+
+
+/* Static fast path
+ *
+ * Code that knows it has an arena can skip the vtable: arena_alloc is
+ * inlined down to a bump of the current chunk, only calling out to get a
+ * new one. Blocks are the same as from kalloc on the arena */
+struct arena_pmm_page_header {
+	struct arena_pmm_page_header* next;
+	int order;
+};
+
+struct arena_pmm {
+	struct arena_pmm_page_header hdr;
+	struct arena_pmm_page_header* current_page;
+	struct arena_pmm_page_header* last_page;
+	size_t current_offset;
+	int grow_order;
+	int p2align;
+	struct pmm* pmm;
+};
+
+typedef struct arena_pmm* arena_t;
+
+/* The arena behind an allocator from make_arena_pmm_allocator */
+arena_t arena_of (allocator_t arena);
+
+struct blk arena_alloc_slow (arena_t, size_t size);
+
+static inline size_t
+arena_align_p2 (size_t val, int p2)
+{
+	return (val + ((size_t)1<<p2) - 1) >> p2 << p2;
+}
+
+static inline size_t
+arena_chunk_size (int order)
+{
+	return (size_t)PAGE_SIZE << order;
+}
+
+static inline struct blk
+arena_alloc (arena_t arena, size_t size)
+{
+	size = arena_align_p2 (size, arena->p2align);
+	size_t offset = arena->current_offset;
+
+	if (size == 0
+		|| offset + size > arena_chunk_size (arena->current_page->order))
+		return arena_alloc_slow (arena, size);
+
+	arena->current_offset = offset + size;
+	return (struct blk) {
+		.ptr = (char*)arena->current_page + offset,
+		.size = size,
+	};
+}
+
+static inline void
+arena_free (arena_t arena, struct blk mem)
+{
+	(void)arena;
+	(void)mem;
+}
@@ -0,0 +1,199 @@
+#include "heap.h"
+#include "page.h"
+#include "macros.h"
+#include "libk/kstring.h"
+
+#include <stdint.h>
+
+/* Multiples of 16, sized to leave little of a cache page unused */
+static const uint16_t class_size[HEAP_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+	320, 384, 448, 512, 672, 800, 1008, 1344, 2032,
+};
+
+#define HEAP_SMALL_MAX 2032
+#define HEAP_GRANULE 16
+
+// Class for each size, in steps of HEAP_GRANULE
+static uint8_t class_lookup[HEAP_SMALL_MAX / HEAP_GRANULE + 1];
+
+static const struct allocator_vtbl heap_vtbl;
+
+static inline void
+heap_lock (struct kernel_heap* heap)
+{
+	while (__atomic_test_and_set (&heap->lock, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n (&heap->lock, __ATOMIC_RELAXED))
+			;
+}
+
+static inline void
+heap_unlock (struct kernel_heap* heap)
+{
+	__atomic_clear (&heap->lock, __ATOMIC_RELEASE);
+}
+
+/* Pages kept by empty classes, the only memory the heap holds spare.
+ * Called by the pmm from any CPU, maybe while a class is growing, so never
+ * waits for the lock */
+static size_t
+heap_shrink (void* data, size_t pages)
+{
+	struct kernel_heap* heap = data;
+
+	if (__atomic_test_and_set (&heap->lock, __ATOMIC_ACQUIRE))
+		return 0;
+
+	size_t freed = 0;
+	for (int c=0; c<HEAP_CLASSES && freed < pages; c++)
+		freed += object_cache_shrink (&heap->small[c]);
+	heap_unlock (heap);
+
+	return freed;
+}
+
+void
+heap_initialise (struct kernel_heap* heap, struct pmm* pmm,
+				 void* begin, void* end)
+{
+	// Built once. The last entry is a nonzero class after that
+	if (class_lookup[ARRAY_LENGTH(class_lookup) - 1] == 0) {
+		int c = 0;
+		for (size_t i=0; i<ARRAY_LENGTH(class_lookup); i++) {
+			while (class_size[c] < i * HEAP_GRANULE)
+				c++;
+			class_lookup[i] = c;
+		}
+	}
+
+	*heap = (struct kernel_heap) {
+		.pmm = pmm,
+	};
+	large_allocator_initialise (&heap->large, pmm, begin, end);
+
+	for (int c=0; c<HEAP_CLASSES; c++)
+		object_cache_initialise (&heap->small[c], pmm, class_size[c]);
+
+	heap->shrinker = (struct pmm_shrinker) {
+		.shrink = heap_shrink,
+		.data = heap,
+	};
+	pmm_register_shrinker (pmm, &heap->shrinker);
+}
+
+struct allocator
+heap_allocator (struct kernel_heap* heap)
+{
+	return (struct allocator) {
+		.self = heap,
+		.vtbl = &heap_vtbl,
+	};
+}
+
+static inline int
+size_class (size_t size)
+{
+	return class_lookup[(size + HEAP_GRANULE - 1) / HEAP_GRANULE];
+}
+
+static struct blk
+heap_alloc (void* self, size_t size)
+{
+	struct kernel_heap* heap = self;
+
+	if (size > HEAP_SMALL_MAX)
+		return kalloc (large_allocator (&heap->large), size);
+
+	int c = size_class (size);
+	heap_lock (heap);
+	void* ptr = object_cache_alloc (&heap->small[c]);
+	heap_unlock (heap);
+	if (!ptr)
+		return (struct blk) {};
+
+	return (struct blk) { .ptr = ptr, .size = class_size[c] };
+}
+
+/* Large blocks are told apart by address, as aligned ones may be small */
+static inline bool
+heap_is_large (struct kernel_heap* heap, void* ptr)
+{
+	return ptr >= heap->large.begin && ptr < heap->large.end;
+}
+
+static struct blk
+heap_alloc_aligned (void* self, size_t size, size_t align)
+{
+	struct kernel_heap* heap = self;
+
+	// Every size class is a multiple of the granule, and so aligned to it
+	if (align <= HEAP_GRANULE)
+		return heap_alloc (heap, size);
+
+	return kalloc_aligned (large_allocator (&heap->large), size, align);
+}
+
+static void
+heap_free (void* self, struct blk blk)
+{
+	struct kernel_heap* heap = self;
+
+	if (heap_is_large (heap, blk.ptr)) {
+		kfree (large_allocator (&heap->large), blk);
+		return;
+	}
+
+	heap_lock (heap);
+	object_cache_free (&heap->small[size_class (blk.size)], blk.ptr);
+	heap_unlock (heap);
+}
+
+static struct blk
+heap_realloc (void* self, struct blk blk, size_t size)
+{
+	struct kernel_heap* heap = self;
+
+	bool large = heap_is_large (heap, blk.ptr);
+
+	if (large && size > HEAP_SMALL_MAX)
+		return krealloc (large_allocator (&heap->large), blk, size);
+
+	if (!large && size <= HEAP_SMALL_MAX
+		&& size_class (blk.size) == size_class (size)) {
+		int c = size_class (size);
+		return (struct blk) { .ptr = blk.ptr, .size = class_size[c] };
+	}
+
+	// Changing class, at most one small block to copy
+	struct blk moved = heap_alloc (heap, size);
+	if (!moved.ptr)
+		return moved;
+
+	memcpy (moved.ptr, blk.ptr, MIN (blk.size, moved.size));
+	heap_free (heap, blk);
+	return moved;
+}
+
+static void
+heap_del (void* self)
+{
+	struct kernel_heap* heap = self;
+
+	pmm_unregister_shrinker (heap->pmm, &heap->shrinker);
+	heap_lock (heap);
+	for (int c=0; c<HEAP_CLASSES; c++)
+		object_cache_clear (&heap->small[c]);
+	heap_unlock (heap);
+
+	allocator_t large = large_allocator (&heap->large);
+	DELETE_IFACE (large);
+}
+
+static const struct allocator_vtbl
+heap_vtbl = {
+	.alloc = heap_alloc,
+	.realloc = heap_realloc,
+	.free = heap_free,
+	.del = heap_del,
+	.alloc_aligned = heap_alloc_aligned,
+};
@@ -1,11 +1,41 @@
 #pragma once
+/*
+ * General purpose kernel heap.
+ *
+ * Small allocations are rounded up to one of HEAP_CLASSES size classes, and
+ * each class packs its objects into pages (an object_cache per class). Pages
+ * go back to the PMM once they are empty.
+ *
+ * Larger allocations go to a large_allocator, so they get their own page
+ * aligned range of address space, and can be resized without copying.
+ *
+ * The heap registers a shrinker with the PMM, which frees the page each
+ * class keeps around when it has no objects left. The PMM may call it from
+ * any CPU, so the classes are guarded by a lock the shrinker only tries.
+ *
+ * Otherwise not thread safe, callers must serialise access to a heap.
+ */
 
 #include "allocator.h"
+#include "object_cache.h"
+#include "large_allocator.h"
+#include "pmm.h"
 
-struct pmm;
+#define HEAP_CLASSES 21
 
 struct kernel_heap {
 	struct pmm* pmm;
+	struct object_cache small[HEAP_CLASSES];
+	struct large_allocator large;
+	struct pmm_shrinker shrinker;
+	bool lock; // Over small, against the shrinker
 };
 
+/* Set up a heap, with [begin, end) as the (unused) address range for
+ * large allocations */
+void heap_initialise (struct kernel_heap* storage, struct pmm*,
+					  void* begin, void* end);
+
+/* Allocators from the heap return 16 byte aligned blocks. Deleting the
+ * allocator frees everything still allocated from it */
 struct allocator heap_allocator (struct kernel_heap* storage);
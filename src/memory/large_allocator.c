@@ -0,0 +1,151 @@
+#include "large_allocator.h"
+#include "page.h"
+#include "pmm.h"
+#include "vaddress_space.h"
+#include "drivers/mmu.h"
+#include "macros.h"
+
+static const struct allocator_vtbl large_vtbl;
+
+void
+large_allocator_initialise (struct large_allocator* large, struct pmm* pmm,
+							void* begin, void* end)
+{
+	*large = (struct large_allocator) {
+		.pmm = pmm,
+		.vaddr = vaddress_space_new (pmm, begin, end),
+		.begin = begin,
+		.end = end,
+	};
+}
+
+allocator_t
+large_allocator (struct large_allocator* large)
+{
+	return (allocator_t) {
+		.self = large,
+		.vtbl = &large_vtbl,
+	};
+}
+
+/* Back [base, base + size) with fresh pages. On failure nothing is left
+ * mapped */
+static bool
+large_map (struct large_allocator* large, char* base, size_t size)
+{
+	for (size_t off = 0; off < size; off += PAGE_SIZE) {
+		physical_t page = pmm_allocate_page (large->pmm);
+		if (!page) {
+			if (off)
+				mmu_remove_free (mmu_top_page, base, off, large->pmm);
+			return false;
+		}
+
+		mmu_assign_1 (mmu_top_page, MEMORY_WRITE, page, base + off);
+	}
+
+	large->pages += size / PAGE_SIZE;
+	return true;
+}
+
+static void
+large_unmap (struct large_allocator* large, char* base, size_t size)
+{
+	mmu_remove_free (mmu_top_page, base, size, large->pmm);
+	large->pages -= size / PAGE_SIZE;
+}
+
+static struct blk
+large_alloc_aligned (void* self, size_t size, size_t align)
+{
+	struct large_allocator* large = self;
+	size = ROUND_UP_P2 (size, PAGE_SIZE);
+
+	char* base = vaddress_allocate_aligned (large->vaddr, size,
+											MAX (align, PAGE_SIZE));
+	if (!base)
+		return (struct blk) {};
+
+	if (!large_map (large, base, size)) {
+		vaddress_free (large->vaddr, base, size);
+		return (struct blk) {};
+	}
+
+	return (struct blk) { .ptr = base, .size = size };
+}
+
+static struct blk
+large_alloc (void* self, size_t size)
+{
+	return large_alloc_aligned (self, size, PAGE_SIZE);
+}
+
+static void
+large_free (void* self, struct blk blk)
+{
+	struct large_allocator* large = self;
+	size_t size = ROUND_UP_P2 (blk.size, PAGE_SIZE);
+
+	large_unmap (large, blk.ptr, size);
+	vaddress_free (large->vaddr, blk.ptr, size);
+}
+
+static struct blk
+large_realloc (void* self, struct blk blk, size_t new_size)
+{
+	struct large_allocator* large = self;
+	char* base = blk.ptr;
+	size_t size = ROUND_UP_P2 (blk.size, PAGE_SIZE);
+	new_size = ROUND_UP_P2 (new_size, PAGE_SIZE);
+
+	if (new_size <= size) {
+		if (new_size < size) {
+			large_unmap (large, base + new_size, size - new_size);
+			vaddress_free (large->vaddr, base + new_size, size - new_size);
+		}
+		return (struct blk) { .ptr = base, .size = new_size };
+	}
+
+	char* to = base;
+	if (!vaddress_extend (large->vaddr, base, size, new_size)) {
+		// No room above, so the pages move instead
+		to = vaddress_allocate_aligned (large->vaddr, new_size, PAGE_SIZE);
+		if (!to)
+			return (struct blk) {};
+	}
+
+	if (!large_map (large, to + size, new_size - size)) {
+		vaddress_free (large->vaddr, to == base ? base + size : to,
+					   to == base ? new_size - size : new_size);
+		return (struct blk) {};
+	}
+
+	if (to != base) {
+		mmu_move (mmu_top_page, base, to, size);
+		vaddress_free (large->vaddr, base, size);
+	}
+
+	return (struct blk) { .ptr = to, .size = new_size };
+}
+
+static void
+large_del (void* self)
+{
+	struct large_allocator* large = self;
+
+	// Unmapped parts of the range are skipped, so this only costs as much
+	// as the blocks still live
+	mmu_remove_free (mmu_top_page, large->begin,
+					 (char*)large->end - (char*)large->begin, large->pmm);
+	vaddress_space_free (large->vaddr);
+	large->pages = 0;
+}
+
+static const struct allocator_vtbl
+large_vtbl = {
+	.alloc = large_alloc,
+	.realloc = large_realloc,
+	.free = large_free,
+	.del = large_del,
+	.alloc_aligned = large_alloc_aligned,
+};
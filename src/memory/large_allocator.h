@@ -0,0 +1,34 @@
+#pragma once
+/*
+ * Allocator for large blocks, each a page aligned range of virtual address
+ * space backed by separately mapped pages.
+ *
+ * As the pages need not be contiguous, realloc never copies: it maps or
+ * unmaps pages at the end of the block, extending the address range in place
+ * when the space above is free, or moving the existing page mappings to a
+ * new range when it is not. Either way it costs O(pages), not O(bytes).
+ *
+ * Not thread safe, callers must serialise access.
+ */
+
+#include "allocator.h"
+
+struct pmm;
+struct vaddress_space;
+
+struct large_allocator {
+	struct pmm* pmm;
+	struct vaddress_space* vaddr;
+	void* begin;
+	void* end;
+
+	size_t pages;
+};
+
+/* Set up an allocator using the (unused) address range [begin, end) */
+void large_allocator_initialise (struct large_allocator* storage,
+								 struct pmm*, void* begin, void* end);
+
+/* Blocks are rounded up to whole pages. Deleting the allocator frees
+ * everything still allocated from it */
+allocator_t large_allocator (struct large_allocator* storage);
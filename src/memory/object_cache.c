@@ -0,0 +1,158 @@
+#include "object_cache.h"
+#include "page.h"
+#include "pmm.h"
+#include "panic.h"
+
+#include <stdint.h>
+
+/* Each page starts with a header, objects fill the rest. Freed objects are
+ * linked through their first word, untouched ones are handed out in order. */
+struct object_cache_page {
+	struct object_cache_page* next;
+	struct object_cache_page* prev;
+	void* free;
+	int used;
+	int fresh; // Objects never handed out start at index fresh
+};
+
+#define OBJECT_ALIGN sizeof(void*)
+
+static inline struct object_cache_page*
+page_of (void* object)
+{
+	return (void*)((uintptr_t)object & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static inline char*
+page_object (struct object_cache* cache, struct object_cache_page* page, int i)
+{
+	return (char*)(page + 1) + i * cache->object_size;
+}
+
+void
+object_cache_initialise (struct object_cache* cache, struct pmm* pmm,
+						 size_t size)
+{
+	size = (size + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1);
+	if (size < sizeof(void*))
+		size = sizeof(void*);
+
+	*cache = (struct object_cache) {
+		.pmm = pmm,
+		.object_size = size,
+		.per_page = (PAGE_SIZE - sizeof(struct object_cache_page)) / size,
+	};
+
+	assert (cache->per_page > 0, "Object too large for cache");
+}
+
+static void
+list_push (struct object_cache_page** list, struct object_cache_page* page)
+{
+	page->prev = NULL;
+	page->next = *list;
+	if (page->next)
+		page->next->prev = page;
+	*list = page;
+}
+
+static void
+list_remove (struct object_cache_page** list, struct object_cache_page* page)
+{
+	if (page->prev)
+		page->prev->next = page->next;
+	else
+		*list = page->next;
+
+	if (page->next)
+		page->next->prev = page->prev;
+}
+
+void*
+object_cache_alloc (struct object_cache* cache)
+{
+	struct object_cache_page* page = cache->partial;
+
+	if (!page) {
+		physical_t phys = pmm_allocate_page (cache->pmm);
+		if (!phys)
+			return NULL;
+
+		page = HHDM_POINTER (phys);
+		*page = (struct object_cache_page) {};
+		list_push (&cache->partial, page);
+		cache->pages++;
+	}
+
+	void* object;
+	if (page->free) {
+		object = page->free;
+		page->free = *(void**)object;
+	} else {
+		object = page_object (cache, page, page->fresh++);
+	}
+
+	if (++page->used == cache->per_page) {
+		list_remove (&cache->partial, page);
+		list_push (&cache->full, page);
+	}
+
+	cache->objects++;
+	return object;
+}
+
+void
+object_cache_free (struct object_cache* cache, void* object)
+{
+	struct object_cache_page* page = page_of (object);
+
+	if (page->used-- == cache->per_page) {
+		list_remove (&cache->full, page);
+		list_push (&cache->partial, page);
+	}
+
+	*(void**)object = page->free;
+	page->free = object;
+	cache->objects--;
+
+	// Keep the page if it is the only one left with space
+	if (page->used == 0 && (page->prev || page->next)) {
+		list_remove (&cache->partial, page);
+		pmm_free_page (cache->pmm, HHDM_PHYSICAL (page));
+		cache->pages--;
+	}
+}
+
+size_t
+object_cache_shrink (struct object_cache* cache)
+{
+	struct object_cache_page* page = cache->partial;
+	if (!page || page->used || page->next)
+		return 0;
+
+	// Empty pages are only kept when they are the last with space
+	list_remove (&cache->partial, page);
+	pmm_free_page (cache->pmm, HHDM_PHYSICAL (page));
+	cache->pages--;
+	return 1;
+}
+
+static void
+list_free (struct object_cache* cache, struct object_cache_page* page)
+{
+	while (page) {
+		struct object_cache_page* next = page->next;
+		pmm_free_page (cache->pmm, HHDM_PHYSICAL (page));
+		page = next;
+	}
+}
+
+void
+object_cache_clear (struct object_cache* cache)
+{
+	list_free (cache, cache->partial);
+	list_free (cache, cache->full);
+
+	cache->partial = cache->full = NULL;
+	cache->pages = cache->objects = 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+/*
+ * A cache of fixed size objects, packed into pages from the physical memory
+ * manager. Pages are returned to the PMM once all their objects are freed
+ * (except the last partly used page, which is kept to avoid thrashing).
+ *
+ * Meant for small kernel metadata that would otherwise take a whole page.
+ * Not thread safe, callers must serialise access to a cache.
+ */
+
+#include "types.h"
+
+struct pmm; // fwd
+struct object_cache_page; // fwd
+
+struct object_cache {
+	struct pmm* pmm;
+	struct object_cache_page* partial; // Pages with free objects
+	struct object_cache_page* full;
+	size_t object_size;
+	int per_page;
+
+	size_t pages;
+	size_t objects; // In use
+};
+
+/* Set up an empty cache for objects of size bytes (at most about a page) */
+void object_cache_initialise (struct object_cache*, struct pmm*, size_t size);
+
+/* Returns an uninitialised object, or NULL if out of memory */
+void* object_cache_alloc (struct object_cache*);
+
+/* Return an object from object_cache_alloc to the cache */
+void object_cache_free (struct object_cache*, void* object);
+
+/* Return the empty page kept for reuse to the PMM, returns pages freed */
+size_t object_cache_shrink (struct object_cache*);
+
+/* Return every page to the PMM, freeing all objects at once */
+void object_cache_clear (struct object_cache*);
@@ -4,6 +4,7 @@
 #include "panic.h"
 #include "libk/kstring.h"
 #include "macros.h"
+#include "drivers/cpu.h"
 
 /*
  * Physical memory manager / allocator
@@ -16,80 +17,634 @@
  *
  * Structures (each box = 1 page):
  *
- *    pmm
- *  +=====+
- *  |     |             +==========+====+====+====+====
- *  |  0  | -- ctrl --> | ctrl_blk | usable pages ...
- *  |     |             +==========+====+====+====+====
- *  |     |             +==========+====+====+====+====
- *  |  1  | -- ctrl --> | ctrl_blk | usable pages ...
- *  |     |             +==========+====+====+====+====
- *  | ... |
- *  +=====+
+ *    pmm        table
+ *  +=====+     +=====+
+ *  |     |     |     |             +==========+====+====+====+=====+
+ *  |  0  | --> |  0  | -- ctrl --> | ctrl_blk | usable pages ... | db |
+ *  |     |     |     |             +==========+====+====+====+=====+
+ *  |     |     |     |             +==========+====+====+====+=====+
+ *  |  1  |     |  1  | -- ctrl --> | ctrl_blk | usable pages ... | db |
+ *  |     |     |     |             +==========+====+====+====+=====+
+ *  | ... |     | ... |
+ *  +=====+     +=====+
  *
- * ctrl_blk is a bitset of free pages
+ * ctrl_blk is a bitset of free pages, prefixed by a summary bitset with one
+ * bit per bitset word (set = word has a free page). Each table keeps a
+ * similar summary over its entries (set = entry has free pages), and the pmm
+ * over its tables. Finding a free page is then four ctz operations,
+ * independent of how full memory is.
+ *
+ * Tables are taken from the memory being added as they fill up, so there is
+ * no fixed limit on the amount of memory managed.
+ *
+ * Each block ends with its page frame database (db): a struct page for each
+ * usable page, holding a reference count, flags and owner. It is found from
+ * the block's end address, so entries need no extra pointer.
+ *
+ * Control pages (and the db) are only filled in when their block is first
+ * allocated from, so adding memory costs the same however much of it there
+ * is. Until then the whole block is known to be free from its counts alone.
+ *
+ * Blocks too small to be worth a whole control page are compact: their
+ * bitset is two words in a page shared by up to 256 small blocks, and they
+ * have no summaries (two words are quick to scan anyway).
+ *
+ * Single pages go through a per-CPU magazine first: a small stack of cached
+ * free pages, refilled from and drained to the bitsets in batches. Hits on
+ * the magazine only touch the current CPU's cache lines.
+ *
+ * Pages known to be zero are kept on a separate list, linked through their
+ * first word (cleared again when handed out). The list is filled from idle
+ * time by pmm_refill_zeroed, so zeroed allocations skip the clear.
+ *
+ * Allocation is safe from several CPUs at once without locks. Pages are
+ * claimed and released with atomic operations on the bitset words, and
+ * free_pages is reserved before searching, so a block is never oversold.
+ * Summaries are only hints: a bit may be set for an empty word for a short
+ * while, but is re-checked after every clear so it is never missing for a
+ * free one. Each CPU starts searching where it last found a page, spread
+ * over different words, so CPUs rarely contend for the same word.
+ * (Adding memory and the zeroed pool are not yet safe to use concurrently.)
+ *
+ * When memory runs low, caches built on the pmm give pages back through
+ * registered shrinkers. Dropping below the low watermark flags reclaim, which
+ * pmm_reclaim then does from idle time until free memory is back above the
+ * high watermark. An allocation that finds nothing free runs the shrinkers
+ * itself before reporting failure.
+ *
+ * Every block belongs to a NUMA node. The pmm keeps a per-node copy of its
+ * table summary, so pmm_allocate_page_node only visits tables holding free
+ * memory of the wanted node, trying nodes nearest first.
  */
 
-/* Below this many pages, skip actually adding block to allocator.
- * Save resources for later blocks which may be larger */
+/* Below this many pages, a block is compact rather than getting its own
+ * control page */
 #define MIN_BLOCK_SIZE_PAGES 		64
 
-#define PMM_ENTRIES					168
-#define PMM_CTRL_ENTRIES			512
+#define WORDS_FOR_BITS(bits)		(((bits) + 63) / 64)
+
+#define PMM_TABLES					384
+#define PMM_SUMMARY					WORDS_FOR_BITS (PMM_TABLES)
+
+#define PMM_TABLE_ENTRIES			127
+#define PMM_TABLE_SUMMARY			WORDS_FOR_BITS (PMM_TABLE_ENTRIES)
+
+#define PMM_CTRL_SUMMARY			8
+#define PMM_CTRL_ENTRIES			(512 - 2 * PMM_CTRL_SUMMARY)
+#define PMM_CTRL_BITS				(PMM_CTRL_ENTRIES * 64)
+
+/* Page frame database, one struct page per usable page */
+#define PMM_DB_PER_PAGE			(PAGE_SIZE / sizeof(struct page))
+
+_Static_assert (sizeof(struct page) == 16, "Keep struct page small");
+
+/* Bit 0 of every control block is aligned to the largest run size, so
+ * naturally aligned runs are aligned bit ranges and never straddle words */
+#define PMM_RUN_ALIGN_PAGES		(1 << PMM_MAX_ORDER)
+#define PMM_RUN_ALIGN_BYTES		(PMM_RUN_ALIGN_PAGES * PAGE_SIZE)
 
-#define MAX_BLOCK_SIZE_PAGES 	(PMM_CTRL_ENTRIES * 64)
-#define MAX_BLOCK_SIZE_BYTES 	(MAX_BLOCK_SIZE_PAGES * PAGE_SIZE)
 #define MIN_BLOCK_SIZE_BYTES 	(MIN_BLOCK_SIZE_PAGES * PAGE_SIZE)
 
+/* Compact blocks start at a 64 page boundary, so up to 63 padding bits and
+ * 63 pages need two words */
+#define PMM_COMPACT_WORDS		2
+#define PMM_COMPACT_SLOTS		(PAGE_SIZE / sizeof(uint64_t) / PMM_COMPACT_WORDS)
+
 /* Manages a contiguous block of physical memory
  * 4KiB control block, each set bit represents a free page,
- * so we have 4K * 8 = 32K pages, 4K * 32K = 128M bytes */
+ * so we have 496 * 64 = 31K pages, 4K * 31K = 124M bytes
+ *
+ * Besides the summary of non-empty words, full[] has a bit for each word
+ * with all 64 pages free. This is the free-run index for allocations of
+ * 64 pages or more. Smaller runs are found inside single words */
 
 struct pmm_control_block {
+	uint64_t summary[PMM_CTRL_SUMMARY];
+	uint64_t full[PMM_CTRL_SUMMARY];
 	uint64_t entry[PMM_CTRL_ENTRIES];
 } PAGE_ALIGNED;
 
+_Static_assert (PMM_CTRL_SUMMARY * 64 >= PMM_CTRL_ENTRIES, "");
+_Static_assert (PMM_MAX_ORDER <= 12, "Runs must fit in one summary word");
+
+/* Pages of the block are bits [first, first + max_pages) of the bitset,
+ * bit 0 is at physical_start. Bits below first are padding for alignment */
 struct pmm_ctrl_ptr {
 	uint64_t physical_start;
-	struct pmm_control_block* ctrl;
-	uint16_t max_pages;
-	uint16_t free_pages;
-	bool active;
+	union {
+		struct pmm_control_block* ctrl;
+		uint64_t* compact; // PMM_COMPACT_WORDS in a shared page
+	};
+	uint32_t first;
+	uint32_t max_pages;
+	uint32_t free_pages;
+	bool is_compact;
+	bool is_initialised;
+	bool is_initialising; // Claimed by the CPU filling in the control page
+	uint8_t node;
+};
+
+/* Page of control block pointers, 127 * 124M = 15.3 G per table
+ * Entries are globally indexed in table order: pmm_entry() */
+struct pmm_table {
+	struct pmm_ctrl_ptr entry[PMM_TABLE_ENTRIES];
+	uint64_t summary[PMM_TABLE_SUMMARY];
+} PAGE_ALIGNED;
+
+#define PMM_MAGAZINE_SIZE		26
+#define PMM_MAGAZINE_BATCH		(PMM_MAGAZINE_SIZE / 2)
+
+/* Where a CPU last found a page: entry index, and word in its bitset */
+struct pmm_hint {
+	int entry;
+	int word;
 };
 
-/* Manages 168 control blocks, 168 * 128M = 21 G max */
+/* Cache line aligned, so CPUs never share lines */
+struct pmm_magazine {
+	int count;
+	struct pmm_hint hint;
+	size_t hits;
+	size_t misses;
+	size_t refills;
+	size_t drains;
+	physical_t page[PMM_MAGAZINE_SIZE];
+} __attribute__((aligned(64)));
+
+/* One page, allocated from the pmm on first use */
+struct pmm_cpu_cache {
+	struct pmm_magazine magazine[CPU_MAX];
+} PAGE_ALIGNED;
+
+/* Manages up to 384 tables, 384 * 15.3 G = 5.7 P max
+ * Active entries are [0..count), sorted by address so the owner of an
+ * address is a binary search away */
 struct pmm {
-	struct pmm_ctrl_ptr entry[PMM_ENTRIES];
+	struct pmm_table* table[PMM_TABLES];
+	uint64_t summary[PMM_SUMMARY];
+	uint64_t node_summary[PMM_NODES][PMM_SUMMARY]; // Tables with free pages on node
+
+	uint8_t distance[PMM_NODES][PMM_NODES];
+	uint8_t node_order[PMM_NODES][PMM_NODES]; // Nodes by distance, nearest first
+
+	int tables;
+	int count;
+	struct pmm_cpu_cache* cpu;
+
+	uint64_t* compact_page; // Current shared page for compact blocks
+	int compact_used; // Slots used in compact_page
+	int compact_pages;
+
+	physical_t zeroed; // List of clean pages
+	size_t zeroed_count;
+
+	size_t free_pages; // In the bitsets, for the watermarks
+	size_t watermark_low;
+	size_t watermark_high;
+	bool reclaim_wanted; // Fell below low, not yet back above high
+	bool shrinking; // Shrinkers are running
+	struct pmm_shrinker* shrinkers;
+	size_t reclaimed;
 } PAGE_ALIGNED;
 
 REQUIRE_PAGE_SIZED(struct pmm_control_block)
+REQUIRE_PAGE_SIZED(struct pmm_table)
+REQUIRE_PAGE_SIZED(struct pmm_cpu_cache)
 REQUIRE_PAGE_SIZED(struct pmm)
 
 
+/* Bitset helpers, shared by both summary levels */
+
+/* Words may be changed by other CPUs at any time */
+static inline uint64_t
+bit_word (const uint64_t* word)
+{
+	return __atomic_load_n (word, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+bit_set (uint64_t* map, int idx)
+{
+	__atomic_fetch_or (&map[idx / 64], 1ULL << (idx % 64), __ATOMIC_SEQ_CST);
+}
+
+static inline void
+bit_clear (uint64_t* map, int idx)
+{
+	__atomic_fetch_and (&map[idx / 64], ~(1ULL << (idx % 64)), __ATOMIC_SEQ_CST);
+}
+
+/* Clear the single bit mask in *word, true if it was set (lock btr) */
+static inline bool
+bit_claim_one (uint64_t* word, uint64_t mask)
+{
+	return __atomic_fetch_and (word, ~mask, __ATOMIC_SEQ_CST) & mask;
+}
+
+/* Clear all bits of mask in *word, only if they are all set */
+static inline bool
+bit_claim (uint64_t* word, uint64_t mask)
+{
+	uint64_t old = __atomic_load_n (word, __ATOMIC_RELAXED);
+	do {
+		if ((old & mask) != mask)
+			return false;
+	} while (!__atomic_compare_exchange_n (word, &old, old & ~mask, true,
+										   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	return true;
+}
+
+/* Set the bits of mask in *word, returns those that were already set */
+static inline uint64_t
+bit_release (uint64_t* word, uint64_t mask)
+{
+	return __atomic_fetch_or (word, mask, __ATOMIC_SEQ_CST) & mask;
+}
+
+/* Index of lowest set bit in map, or -1 if all clear */
+static inline int
+bit_find_first (const uint64_t* map, int words)
+{
+	for ( int i=0; i<words; i++ ) {
+		uint64_t bits = bit_word (&map[i]);
+		if (bits)
+			return 64 * i + __builtin_ctzll (bits);
+	}
+	return -1;
+}
+
+/* Index of lowest set bit at or after from, or -1 if none */
+static inline int
+bit_find_next (const uint64_t* map, int words, int from)
+{
+	int i = from / 64;
+	if (i >= words)
+		return -1;
+
+	uint64_t bits = bit_word (&map[i]) & ((uint64_t)-1 << (from % 64));
+	while (!bits) {
+		if (++i >= words)
+			return -1;
+		bits = bit_word (&map[i]);
+	}
+
+	return 64 * i + __builtin_ctzll (bits);
+}
+
+/* Bits of a word where a naturally aligned run of 2^order (<= 64) may start */
+static const uint64_t run_start_mask[] = {
+	0xffffffffffffffff,
+	0x5555555555555555,
+	0x1111111111111111,
+	0x0101010101010101,
+	0x0001000100010001,
+	0x0000000100000001,
+	0x0000000000000001,
+};
+
+/* Bits p of word such that bits [p, p + 2^order) are all set, and p is
+ * aligned to 2^order */
+static inline uint64_t
+bit_find_runs (uint64_t word, int order)
+{
+	for ( int shift=1; shift < (1 << order); shift *= 2 )
+		word &= word >> shift;
+	return word & run_start_mask[order];
+}
+
+/* Mask for bits [bit, bit + count) of a single word, count <= 64 */
+static inline uint64_t
+bit_range_mask (int bit, int count)
+{
+	uint64_t ones = count == 64 ? (uint64_t)-1 : (1ULL << count) - 1;
+	return ones << bit;
+}
+
+static inline physical_t
+pmm_ctrl_begin (const struct pmm_ctrl_ptr* p)
+{
+	return p->physical_start + PAGE_SIZE * p->first;
+}
+
+static inline physical_t
+pmm_ctrl_end (const struct pmm_ctrl_ptr* p)
+{
+	return pmm_ctrl_begin (p) + PAGE_SIZE * p->max_pages;
+}
+
+/* Pages holding the struct pages of count frames */
+static inline size_t
+pmm_db_pages (size_t count)
+{
+	return (count + PMM_DB_PER_PAGE - 1) / PMM_DB_PER_PAGE;
+}
+
+/* How many of n pages can be handed out, the rest holding their db */
+static size_t
+pmm_db_split (size_t n)
+{
+	size_t pages = n * PMM_DB_PER_PAGE / (PMM_DB_PER_PAGE + 1);
+	while (pages + pmm_db_pages (pages) > n)
+		pages--;
+	return pages;
+}
+
+/* The db sits right after the block's last usable page */
+static inline struct page*
+pmm_ctrl_db (const struct pmm_ctrl_ptr* p)
+{
+	return HHDM_POINTER (pmm_ctrl_end (p));
+}
+
+static inline struct pmm_ctrl_ptr*
+pmm_entry (struct pmm* pmm, int idx)
+{
+	return &pmm->table[idx / PMM_TABLE_ENTRIES]->entry[idx % PMM_TABLE_ENTRIES];
+}
+
+/* Entry idx has free pages */
+static inline void
+pmm_summary_set (struct pmm* pmm, int idx)
+{
+	const int t = idx / PMM_TABLE_ENTRIES;
+	struct pmm_table* table = pmm->table[t];
+	bit_set (table->summary, idx % PMM_TABLE_ENTRIES);
+	bit_set (pmm->summary, t);
+	bit_set (pmm->node_summary[table->entry[idx % PMM_TABLE_ENTRIES].node], t);
+}
+
+/* Table t has another entry on node with free pages */
+static bool
+pmm_table_has_node (struct pmm_table* table, int node)
+{
+	for ( int e = 0;
+		  (e = bit_find_next (table->summary, PMM_TABLE_SUMMARY, e)) >= 0; e++ )
+	{
+		if (table->entry[e].node == node)
+			return true;
+	}
+
+	return false;
+}
+
+/* Entry idx has no free pages. Each clear is re-checked, in case pages
+ * were freed by another CPU meanwhile */
+static inline void
+pmm_summary_clear (struct pmm* pmm, int idx)
+{
+	const int t = idx / PMM_TABLE_ENTRIES;
+	struct pmm_table* table = pmm->table[t];
+	struct pmm_ctrl_ptr* p = &table->entry[idx % PMM_TABLE_ENTRIES];
+	bit_clear (table->summary, idx % PMM_TABLE_ENTRIES);
+
+	if (bit_find_first (table->summary, PMM_TABLE_SUMMARY) < 0) {
+		bit_clear (pmm->summary, t);
+		if (bit_find_first (table->summary, PMM_TABLE_SUMMARY) >= 0)
+			bit_set (pmm->summary, t);
+	}
+
+	if (!pmm_table_has_node (table, p->node)) {
+		bit_clear (pmm->node_summary[p->node], t);
+		if (pmm_table_has_node (table, p->node))
+			bit_set (pmm->node_summary[p->node], t);
+	}
+
+	if (__atomic_load_n (&p->free_pages, __ATOMIC_SEQ_CST))
+		pmm_summary_set (pmm, idx);
+}
+
+/* Keep the overall free count for the watermarks */
+static inline void
+pmm_free_count_sub (struct pmm* pmm, uint32_t count)
+{
+	size_t free = __atomic_sub_fetch (&pmm->free_pages, count, __ATOMIC_RELAXED);
+	if (free < pmm->watermark_low
+		&& !__atomic_load_n (&pmm->reclaim_wanted, __ATOMIC_RELAXED))
+		__atomic_store_n (&pmm->reclaim_wanted, true, __ATOMIC_RELAXED);
+}
+
+static inline void
+pmm_free_count_add (struct pmm* pmm, uint32_t count)
+{
+	__atomic_add_fetch (&pmm->free_pages, count, __ATOMIC_RELAXED);
+}
+
+/* Reserve count pages of entry idx, false if it has fewer free. The pages
+ * are then certain to be in the bitset for the caller to claim */
+static bool
+pmm_entry_take (struct pmm* pmm, int idx, uint32_t count)
+{
+	struct pmm_ctrl_ptr* p = pmm_entry (pmm, idx);
+	uint32_t free = __atomic_load_n (&p->free_pages, __ATOMIC_RELAXED);
+
+	do {
+		if (free < count)
+			return false;
+	} while (!__atomic_compare_exchange_n (&p->free_pages, &free, free - count,
+										   true, __ATOMIC_SEQ_CST,
+										   __ATOMIC_RELAXED));
+
+	if (free == count)
+		pmm_summary_clear (pmm, idx);
+	pmm_free_count_sub (pmm, count);
+	return true;
+}
+
+/* As pmm_entry_take, for as many as are free up to count. Returns the
+ * number reserved */
+static uint32_t
+pmm_entry_take_some (struct pmm* pmm, int idx, uint32_t count)
+{
+	struct pmm_ctrl_ptr* p = pmm_entry (pmm, idx);
+	uint32_t free = __atomic_load_n (&p->free_pages, __ATOMIC_RELAXED);
+	uint32_t taken;
+
+	do {
+		taken = MIN (free, count);
+		if (taken == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n (&p->free_pages, &free, free - taken,
+										   true, __ATOMIC_SEQ_CST,
+										   __ATOMIC_RELAXED));
+
+	if (free == taken)
+		pmm_summary_clear (pmm, idx);
+	pmm_free_count_sub (pmm, taken);
+	return taken;
+}
+
+/* Count pages of entry idx were returned to its bitset, or not claimed
+ * after pmm_entry_take */
+static void
+pmm_entry_give (struct pmm* pmm, int idx, uint32_t count)
+{
+	struct pmm_ctrl_ptr* p = pmm_entry (pmm, idx);
+	pmm_free_count_add (pmm, count);
+	if (__atomic_fetch_add (&p->free_pages, count, __ATOMIC_SEQ_CST) == 0)
+		pmm_summary_set (pmm, idx);
+}
+
+/* Index of the next entry after idx with free pages, or -1 if none.
+ * Use idx = -1 to find the first */
+static int
+pmm_summary_next (struct pmm* pmm, int idx)
+{
+	const int from_t = (idx + 1) / PMM_TABLE_ENTRIES;
+	const int from_e = (idx + 1) % PMM_TABLE_ENTRIES;
+
+	for ( int t = from_t;
+		  (t = bit_find_next (pmm->summary, PMM_SUMMARY, t)) >= 0; t++ )
+	{
+		int e = bit_find_next (pmm->table[t]->summary, PMM_TABLE_SUMMARY,
+							   t == from_t ? from_e : 0);
+		if (e >= 0)
+			return t * PMM_TABLE_ENTRIES + e;
+	}
+
+	return -1;
+}
+
+/* As pmm_summary_next, but only entries on node */
+static int
+pmm_summary_next_node (struct pmm* pmm, int idx, int node)
+{
+	const int from_t = (idx + 1) / PMM_TABLE_ENTRIES;
+	const int from_e = (idx + 1) % PMM_TABLE_ENTRIES;
+
+	for ( int t = from_t;
+		  (t = bit_find_next (pmm->node_summary[node], PMM_SUMMARY, t)) >= 0; t++ )
+	{
+		struct pmm_table* table = pmm->table[t];
+		for ( int e = t == from_t ? from_e : 0;
+			  (e = bit_find_next (table->summary, PMM_TABLE_SUMMARY, e)) >= 0; e++ )
+		{
+			if (table->entry[e].node == node)
+				return t * PMM_TABLE_ENTRIES + e;
+		}
+	}
+
+	return -1;
+}
+
+/* Sort nodes by distance from each node, ties by number */
+static void
+pmm_node_order_update (struct pmm* pmm)
+{
+	for ( int from=0; from<PMM_NODES; from++ ) {
+		uint8_t* order = pmm->node_order[from];
+		const uint8_t* distance = pmm->distance[from];
+
+		for ( int i=0; i<PMM_NODES; i++ ) {
+			int j = i;
+			for ( ; j > 0 && distance[order[j-1]] > distance[i]; j-- )
+				order[j] = order[j-1];
+			order[j] = i;
+		}
+	}
+}
+
 pmm_t
 pmm_new (void* control_page)
 {
 	require_page_aligned (control_page);
-	return memset (control_page, 0, PAGE_SIZE);
+	struct pmm* pmm = memset (control_page, 0, PAGE_SIZE);
+
+	// ACPI defaults until told otherwise: 10 local, 20 remote
+	for ( int i=0; i<PMM_NODES; i++ ) {
+		for ( int j=0; j<PMM_NODES; j++ )
+			pmm->distance[i][j] = i == j ? 10 : 20;
+	}
+	pmm_node_order_update (pmm);
+
+	return pmm;
+}
+
+void
+pmm_set_node_distance (struct pmm* pmm, int from, int to, int distance)
+{
+	assert (from >= 0 && from < PMM_NODES, "Bad node");
+	assert (to >= 0 && to < PMM_NODES, "Bad node");
+
+	pmm->distance[from][to] = MIN (distance, 255);
+	pmm_node_order_update (pmm);
+}
+
+/* Word i of a control block changed, bring the summaries up to date.
+ * Clears are re-checked, as the word may have been refilled since */
+static inline void
+pmm_ctrl_update (struct pmm_control_block* ctrl, int i)
+{
+	if (bit_word (&ctrl->entry[i])) {
+		bit_set (ctrl->summary, i);
+	} else {
+		bit_clear (ctrl->summary, i);
+		if (bit_word (&ctrl->entry[i]))
+			bit_set (ctrl->summary, i);
+	}
+
+	if (bit_word (&ctrl->entry[i]) == (uint64_t)-1) {
+		bit_set (ctrl->full, i);
+	} else {
+		bit_clear (ctrl->full, i);
+		if (bit_word (&ctrl->entry[i]) == (uint64_t)-1)
+			bit_set (ctrl->full, i);
+	}
 }
 
 static void
-pmm_ctrl_initialise (struct pmm_control_block* ctrl, uint16_t pages)
+pmm_ctrl_initialise (struct pmm_control_block* ctrl, int first, int pages)
 {
 	require_page_aligned (ctrl);
 	memset (ctrl, 0, PAGE_SIZE);
 
-	int full_entries = pages / 64;
-	int extra_bits = pages % 64;
+	for ( int bit=first; bit < first + pages; ) {
+		int i = bit / 64;
+		int count = MIN (64 - bit % 64, first + pages - bit);
 
-	for ( int i=0; i<full_entries; i++ )
-		ctrl->entry[i] = (uint64_t)-1;
+		ctrl->entry[i] = bit_range_mask (bit % 64, count);
+		pmm_ctrl_update (ctrl, i);
+		bit += count;
+	}
+}
 
-	if (extra_bits)
-		ctrl->entry[full_entries] = ((uint64_t)-1) >> (64 - extra_bits);
+static void
+pmm_compact_page_new (struct pmm* pmm, physical_t page)
+{
+	pmm->compact_page = memset (HHDM_POINTER (page), 0, PAGE_SIZE);
+	pmm->compact_used = 0;
+	pmm->compact_pages++;
 }
 
 static void
+pmm_setup_compact (struct pmm* pmm, struct pmm_ctrl_ptr* p,
+				   physical_t start, size_t size)
+{
+	uint64_t* bits = pmm->compact_page
+		+ PMM_COMPACT_WORDS * pmm->compact_used++;
+
+	physical_t aligned = ROUND_DOWN_P2 (start, 64 * PAGE_SIZE);
+	int first = (start - aligned) / PAGE_SIZE;
+	int pages = pmm_db_split (size / PAGE_SIZE);
+
+	for ( int bit=first; bit < first + pages; bit++ )
+		bit_set (bits, bit);
+
+	*p = (struct pmm_ctrl_ptr) {
+		.compact = bits,
+		.physical_start = aligned,
+		.first = first,
+		.max_pages = pages,
+		.free_pages = pages,
+		.is_compact = true,
+		.is_initialised = true,
+	};
+
+	// Small enough to clear now, the block is ready for use
+	memset (pmm_ctrl_db (p), 0, pmm_db_pages (pages) * PAGE_SIZE);
+}
+
+/* Returns the bytes used, anything past that is left for another block */
+static size_t
 pmm_setup_entry (struct pmm_ctrl_ptr* p, physical_t start, size_t size)
 {
 	// First page becomes control block
@@ -97,132 +652,1134 @@ pmm_setup_entry (struct pmm_ctrl_ptr* p, physical_t start, size_t size)
 	start += PAGE_SIZE;
 	size -= PAGE_SIZE;
 
-	size_t pages = size / PAGE_SIZE;
-	pmm_ctrl_initialise (ctrl, pages);
+	// Then as many pages as fit in the bitset after padding, and their db
+	physical_t aligned = ROUND_DOWN_P2 (start, PMM_RUN_ALIGN_BYTES);
+	int first = (start - aligned) / PAGE_SIZE;
+	int pages = MIN (pmm_db_split (size / PAGE_SIZE),
+					 (size_t)(PMM_CTRL_BITS - first));
 
 	*p = (struct pmm_ctrl_ptr) {
 		.ctrl = ctrl,
-		.physical_start = start,
+		.physical_start = aligned,
+		.first = first,
 		.max_pages = pages,
 		.free_pages = pages,
-		.active = true,
 	};
+
+	return (1 + pages + pmm_db_pages (pages)) * PAGE_SIZE;
+}
+
+/* Index of the first entry starting above physical. Entries are kept sorted
+ * by address, so this is also where a new block at physical belongs */
+static int
+pmm_search (struct pmm* pmm, physical_t physical)
+{
+	int lo = 0;
+	int hi = pmm->count;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (pmm_ctrl_begin (pmm_entry (pmm, mid)) <= physical)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Index of the entry containing physical, or -1 if not managed by pmm */
+static int
+pmm_find_entry (struct pmm* pmm, physical_t physical)
+{
+	int i = pmm_search (pmm, physical) - 1;
+	if (i < 0)
+		return -1;
+
+	if (physical >= pmm_ctrl_end (pmm_entry (pmm, i)))
+		return -1;
+
+	return i;
+}
+
+/* Recompute the table and pmm summaries from the entry free counts */
+static void
+pmm_summary_rebuild (struct pmm* pmm)
+{
+	memset (pmm->summary, 0, sizeof(pmm->summary));
+	memset (pmm->node_summary, 0, sizeof(pmm->node_summary));
+	for ( int t=0; t<pmm->tables; t++ )
+		memset (pmm->table[t]->summary, 0, sizeof(pmm->table[t]->summary));
+
+	for ( int i=0; i<pmm->count; i++ ) {
+		if (pmm_entry (pmm, i)->free_pages)
+			pmm_summary_set (pmm, i);
+	}
 }
 
 void
-pmm_add (struct pmm* pmm, physical_t start, size_t size)
+pmm_add_node (struct pmm* pmm, physical_t start, size_t size, int node)
 {
 	require_page_aligned (start);
+	assert (node >= 0 && node < PMM_NODES, "Bad node");
 
 	size = ROUND_DOWN (size, PAGE_SIZE);
 
-	size_t remaining;
-	if (size > MAX_BLOCK_SIZE_BYTES) {
-		// Split block
-		remaining = size - MAX_BLOCK_SIZE_BYTES;
-		size = MAX_BLOCK_SIZE_BYTES;
-	} else if (size < MIN_BLOCK_SIZE_BYTES) {
-		eprintf ("Warning: Memory block %zx+%zx not allocated (%s)\n",
-				 start, size, "too small");
+	if (size == 0)
 		return;
-	} else {
-		remaining = 0;
-	}
 
-	for ( int i=0; i<PMM_ENTRIES; i++ ) {
-		if (!pmm->entry[i].active) {
-			pmm_setup_entry (&pmm->entry[i], start, size);
+	if (pmm->count == pmm->tables * PMM_TABLE_ENTRIES) {
+		// Tables are full, the next one comes out of this block
+		if (pmm->tables == PMM_TABLES) {
+			eprintf ("Warning: Memory block %zx+%zx not allocated (%s)\n",
+					 start, size, "out of resources");
+			return;
+		}
 
-			if (remaining) // Tail recurse
-				return pmm_add (pmm, start + size, remaining);
+		pmm->table[pmm->tables++] = memset (HHDM_POINTER (start), 0, PAGE_SIZE);
+		start += PAGE_SIZE;
+		size -= PAGE_SIZE;
 
+		if (size == 0)
 			return;
-		}
 	}
 
-	eprintf ("Warning: Memory block %zx+%zx not allocated (%s)\n",
-			 start, size, "out of resources");
-	return;
+	bool compact = size < MIN_BLOCK_SIZE_BYTES;
+	if (compact && (!pmm->compact_page
+					|| pmm->compact_used == PMM_COMPACT_SLOTS))
+	{
+		// Shared page is full, the next one comes out of this block
+		pmm_compact_page_new (pmm, start);
+		start += PAGE_SIZE;
+		size -= PAGE_SIZE;
+	}
+
+	// Room for at least one page and its db
+	if (size < 2 * PAGE_SIZE)
+		return;
+
+	int i = pmm_search (pmm, start);
+	bool in_order = i == pmm->count;
+
+	if (!in_order) {
+		// Memory maps are normally sorted, so shifting is rare
+		for ( int j = pmm->count; j > i; j-- )
+			*pmm_entry (pmm, j) = *pmm_entry (pmm, j - 1);
+	}
+
+	size_t remaining = 0;
+	if (compact) {
+		pmm_setup_compact (pmm, pmm_entry (pmm, i), start, size);
+	} else {
+		// Split block if it doesn't fit one bitset
+		size_t used = pmm_setup_entry (pmm_entry (pmm, i), start, size);
+		remaining = size - used;
+		size = used;
+	}
+	pmm_entry (pmm, i)->node = node;
+	pmm->count++;
+	pmm_free_count_add (pmm, pmm_entry (pmm, i)->free_pages);
+
+	if (in_order)
+		pmm_summary_set (pmm, i);
+	else
+		pmm_summary_rebuild (pmm);
+
+	if (remaining) // Tail recurse
+		return pmm_add_node (pmm, start + size, remaining, node);
+}
+
+void
+pmm_add (struct pmm* pmm, physical_t start, size_t size)
+{
+	pmm_add_node (pmm, start, size, 0);
 }
 
-static uint16_t
-pmm_ctrl_alloc (struct pmm_control_block* blk)
+/* Called before a block's bitset is first used. One CPU fills in the
+ * control page, any others wait for it */
+static inline void
+pmm_ctrl_touch (struct pmm_ctrl_ptr* p)
 {
-	for ( int i=0; i<PMM_CTRL_ENTRIES; i++ ) {
-		if (blk->entry[i] == 0)
-			continue;
+	if (__atomic_load_n (&p->is_initialised, __ATOMIC_ACQUIRE))
+		return;
 
-		int bit = __builtin_ctzl (blk->entry[i]);
-		blk->entry[i] &= ~(1ULL << bit);
-		return 64 * i + bit;
+	if (!__atomic_test_and_set (&p->is_initialising, __ATOMIC_ACQUIRE)) {
+		pmm_ctrl_initialise (p->ctrl, p->first, p->max_pages);
+		memset (pmm_ctrl_db (p), 0, pmm_db_pages (p->max_pages) * PAGE_SIZE);
+		__atomic_store_n (&p->is_initialised, true, __ATOMIC_RELEASE);
 	}
 
-	panic ("%s:%i Block %p should have space\n", __FILE__, __LINE__, blk);
+	while (!__atomic_load_n (&p->is_initialised, __ATOMIC_ACQUIRE))
+		;
 }
 
-physical_t
-pmm_allocate_page (struct pmm* pmm)
+/* Claim a single page of block p, reserved by the caller with
+ * pmm_entry_take. The search starts at word *hint, which is left at the
+ * word the page came from */
+static int
+pmm_ctrl_alloc (struct pmm_ctrl_ptr* p, int* hint)
 {
-	for ( int i=0; i<PMM_ENTRIES; i++ ) {
-		struct pmm_ctrl_ptr* p = &pmm->entry[i];
-		if (p->active && p->free_pages) {
-			int idx = pmm_ctrl_alloc (p->ctrl);
-			p->free_pages--;
-			return p->physical_start + PAGE_SIZE * idx;
+	pmm_ctrl_touch (p);
+
+	// The page is certain to be there, but may still be on its way back
+	// from a free on another CPU. Keep looking until it shows up
+	for (;;) {
+		if (p->is_compact) {
+			for ( int i=0; i<PMM_COMPACT_WORDS; i++ ) {
+				uint64_t word;
+				while ((word = bit_word (&p->compact[i]))) {
+					uint64_t mask = word & -word;
+					if (bit_claim_one (&p->compact[i], mask))
+						return 64 * i + __builtin_ctzll (mask);
+				}
+			}
+			continue;
+		}
+
+		struct pmm_control_block* blk = p->ctrl;
+
+		for ( int pass=0; pass<2; pass++ ) {
+			for ( int i = pass ? 0 : *hint;
+				  (i = bit_find_next (blk->summary, PMM_CTRL_SUMMARY, i)) >= 0; i++ )
+			{
+				uint64_t word;
+				while ((word = bit_word (&blk->entry[i]))) {
+					uint64_t mask = word & -word;
+					if (bit_claim_one (&blk->entry[i], mask)) {
+						pmm_ctrl_update (blk, i);
+						*hint = i;
+						return 64 * i + __builtin_ctzll (mask);
+					}
+				}
+
+				// Emptied by someone else, drop the stale summary bit
+				pmm_ctrl_update (blk, i);
+			}
 		}
 	}
+}
 
-	eprintf ("Warning: Physical allocation failure %p\n", pmm);
-	return 0;
+/* Lowest count set bits of word */
+static inline uint64_t
+bit_lowest (uint64_t word, int count)
+{
+	uint64_t mask = 0;
+	for ( ; word && count; count-- ) {
+		mask |= word & -word;
+		word &= word - 1;
+	}
+	return mask;
 }
 
-void
-pmm_free_page (struct pmm* pmm, physical_t physical)
+/* Claim up to count free bits of *word in one go, storing their indices
+ * (plus base) to idx. Returns the number claimed */
+static int
+pmm_word_alloc_many (uint64_t* word, int base, int* idx, int count)
 {
-	if (physical == 0)
-		return;
+	uint64_t mask = bit_lowest (bit_word (word), count);
+	if (!mask)
+		return 0;
 
-	for ( int i=0; i<PMM_ENTRIES; i++ ) {
-		struct pmm_ctrl_ptr* p = &pmm->entry[i];
-		if (p->active && (physical >= p->physical_start)
-			&& (physical < (p->physical_start + PAGE_SIZE * p->max_pages)))
-		{
-			int pageindex = (physical - p->physical_start) / PAGE_SIZE;
-			int entry = pageindex / 64;
-			int bit = pageindex % 64;
+	// Bits taken by someone else in the meantime are simply not ours
+	uint64_t claimed = __atomic_fetch_and (word, ~mask, __ATOMIC_SEQ_CST) & mask;
 
-			if (p->ctrl->entry[entry] & (1ULL << bit))
-				panic ("%s:%i %p Double free (block %zx)\n",
-					__FILE__, __LINE__, pmm, physical);
+	int n = 0;
+	for ( ; claimed; claimed &= claimed - 1 )
+		idx[n++] = base + __builtin_ctzll (claimed);
+	return n;
+}
 
-			p->ctrl->entry[entry] |= (1ULL << bit);
-			p->free_pages++;
+/* As pmm_ctrl_alloc, for count pages reserved by the caller. Takes many
+ * pages from each bitset word at once */
+static void
+pmm_ctrl_alloc_many (struct pmm_ctrl_ptr* p, int* hint, int* idx, int count)
+{
+	pmm_ctrl_touch (p);
 
-			return;
+	int n = 0;
+	while (n < count) {
+		if (p->is_compact) {
+			for ( int i=0; i<PMM_COMPACT_WORDS && n < count; i++ )
+				n += pmm_word_alloc_many (&p->compact[i], 64 * i,
+										  idx + n, count - n);
+			continue;
 		}
-	}
 
-	panic ("%s:%i %p Bad free (block %zx)\n",
-		   __FILE__, __LINE__, pmm, physical);
+		struct pmm_control_block* blk = p->ctrl;
+
+		for ( int pass=0; pass<2 && n < count; pass++ ) {
+			for ( int i = pass ? 0 : *hint;
+				  n < count
+				  && (i = bit_find_next (blk->summary, PMM_CTRL_SUMMARY, i)) >= 0;
+				  i++ )
+			{
+				n += pmm_word_alloc_many (&blk->entry[i], 64 * i,
+										  idx + n, count - n);
+				pmm_ctrl_update (blk, i);
+				*hint = i;
+			}
+		}
+	}
 }
 
-struct pmm_stat
-pmm_count_pages (struct pmm* pmm)
+/* Claim whole words [i, i + count) if they are all free */
+static bool
+pmm_ctrl_claim_words (struct pmm_control_block* blk, int i, int count)
 {
-	struct pmm_stat stat = {
-		.total = 1,
-		.overhead = 1,
-	};
+	for ( int w=i; w < i + count; w++ ) {
+		bool claimed = bit_claim (&blk->entry[w], (uint64_t)-1);
+		pmm_ctrl_update (blk, w);
+		if (claimed)
+			continue;
 
-	for ( int i=0; i<PMM_ENTRIES; i++ ) {
-		struct pmm_ctrl_ptr* p = &pmm->entry[i];
-		if (p->active) {
-			stat.overhead++;
-			stat.free += p->free_pages;
-			stat.used += (p->max_pages - p->free_pages);
-			stat.total += 1 + p->max_pages;
+		// Lost a race for part of the run, hand back what was taken
+		while (w --> i) {
+			bit_release (&blk->entry[w], (uint64_t)-1);
+			pmm_ctrl_update (blk, w);
 		}
+		return false;
+	}
+
+	return true;
+}
+
+/* Claim a naturally aligned run of 2^order pages from *word, returns the
+ * first bit or -1 */
+static int
+pmm_word_alloc_run (uint64_t* word, int order)
+{
+	uint64_t runs;
+	while ((runs = bit_find_runs (bit_word (word), order))) {
+		int bit = __builtin_ctzll (runs);
+		if (bit_claim (word, bit_range_mask (bit, 1 << order)))
+			return bit;
 	}
+	return -1;
+}
+
+/* Claim a naturally aligned run of 2^order pages, returns first bit or -1 */
+static int
+pmm_ctrl_alloc_run (struct pmm_ctrl_ptr* p, int order)
+{
+	pmm_ctrl_touch (p);
+
+	if (p->is_compact) {
+		// Never a whole word free, so order < 6
+		for ( int i=0; i<PMM_COMPACT_WORDS && order < 6; i++ ) {
+			int bit = pmm_word_alloc_run (&p->compact[i], order);
+			if (bit >= 0)
+				return 64 * i + bit;
+		}
+		return -1;
+	}
+
+	struct pmm_control_block* blk = p->ctrl;
+
+	if (order >= 6) {
+		// Whole words, search the index of full words
+		int words = 1 << (order - 6);
+
+		for ( int s=0; s<PMM_CTRL_SUMMARY; s++ ) {
+			uint64_t runs = bit_find_runs (bit_word (&blk->full[s]), order - 6);
+			for ( ; runs; runs &= runs - 1 ) {
+				int i = 64 * s + __builtin_ctzll (runs);
+				if (pmm_ctrl_claim_words (blk, i, words))
+					return 64 * i;
+			}
+		}
+		return -1;
+	}
+
+	for ( int s=0; s<PMM_CTRL_SUMMARY; s++ ) {
+		uint64_t words = bit_word (&blk->summary[s]);
+		for ( ; words; words &= words - 1 ) {
+			int i = 64 * s + __builtin_ctzll (words);
+			int bit = pmm_word_alloc_run (&blk->entry[i], order);
+			if (bit < 0)
+				continue;
+
+			pmm_ctrl_update (blk, i);
+			return 64 * i + bit;
+		}
+	}
+	return -1;
+}
+
+/* Take a single page from entry i, reserved by the caller */
+static physical_t
+pmm_bitmap_alloc_entry (struct pmm* pmm, int i, struct pmm_hint* hint)
+{
+	struct pmm_ctrl_ptr* p = pmm_entry (pmm, i);
+	int idx = pmm_ctrl_alloc (p, &hint->word);
+	hint->entry = i;
+	return p->physical_start + PAGE_SIZE * idx;
+}
+
+/* Take a single page straight from the bitsets, 0 if none free.
+ * Starts from the entry in hint, wrapping around once */
+static physical_t
+pmm_bitmap_alloc (struct pmm* pmm, struct pmm_hint* hint)
+{
+	bool wrapped = false;
+
+	for ( int i = hint->entry - 1; ; ) {
+		i = pmm_summary_next (pmm, i);
+		if (i < 0) {
+			if (wrapped)
+				return 0;
+			wrapped = true;
+			continue;
+		}
+
+		if (pmm_entry_take (pmm, i, 1))
+			return pmm_bitmap_alloc_entry (pmm, i, hint);
+	}
+}
+
+/* Take up to count pages straight from the bitsets into pages, as
+ * pmm_bitmap_alloc. Returns the number taken */
+static size_t
+pmm_bitmap_alloc_batch (struct pmm* pmm, struct pmm_hint* hint,
+						physical_t* pages, size_t count)
+{
+	enum { CHUNK = 64 };
+	int idx[CHUNK];
+	size_t n = 0;
+	bool wrapped = false;
+
+	for ( int i = hint->entry - 1; n < count; ) {
+		i = pmm_summary_next (pmm, i);
+		if (i < 0) {
+			if (wrapped)
+				break;
+			wrapped = true;
+			continue;
+		}
+
+		uint32_t taken = pmm_entry_take_some (pmm, i, MIN (count - n, CHUNK));
+		if (!taken)
+			continue;
+
+		struct pmm_ctrl_ptr* p = pmm_entry (pmm, i);
+		pmm_ctrl_alloc_many (p, &hint->word, idx, taken);
+		hint->entry = i;
+
+		for ( uint32_t k=0; k<taken; k++ )
+			pages[n++] = p->physical_start + PAGE_SIZE * idx[k];
+
+		// Stay on this entry while it has pages
+		i--;
+	}
+
+	return n;
+}
+
+static void pmm_bitmap_free (struct pmm*, physical_t, int order);
+static void pmm_bitmap_free_pages (struct pmm*, physical_t* pages, size_t count);
+static void sort_physical (physical_t* arr, size_t count);
+
+/* Search hint for the current CPU */
+static struct pmm_hint*
+pmm_hint (struct pmm* pmm)
+{
+	static struct pmm_hint boot_hint; // Until the cache page exists
+
+	struct pmm_cpu_cache* cpu = __atomic_load_n (&pmm->cpu, __ATOMIC_ACQUIRE);
+	return cpu ? &cpu->magazine[cpu_current_index ()].hint : &boot_hint;
+}
+
+/* Magazine for the current CPU, NULL if the cache can't be set up */
+static struct pmm_magazine*
+pmm_magazine (struct pmm* pmm)
+{
+	struct pmm_cpu_cache* cpu = __atomic_load_n (&pmm->cpu, __ATOMIC_ACQUIRE);
+
+	if (!cpu) {
+		physical_t page = pmm_bitmap_alloc (pmm, pmm_hint (pmm));
+		if (page == 0)
+			return NULL;
+
+		struct pmm_cpu_cache* fresh = memset (HHDM_POINTER (page), 0, PAGE_SIZE);
+		for ( int i=0; i<CPU_MAX; i++ )
+			fresh->magazine[i].hint.word = i * PMM_CTRL_ENTRIES / CPU_MAX;
+
+		if (__atomic_compare_exchange_n (&pmm->cpu, &cpu, fresh, false,
+										 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			cpu = fresh;
+		else
+			pmm_bitmap_free (pmm, page, 0); // Another CPU got there first
+	}
+
+	return &cpu->magazine[cpu_current_index ()];
+}
+
+static void
+pmm_magazine_refill (struct pmm* pmm, struct pmm_magazine* mag)
+{
+	mag->refills++;
+	while (mag->count < PMM_MAGAZINE_BATCH) {
+		physical_t page = pmm_bitmap_alloc (pmm, &mag->hint);
+		if (page == 0)
+			return;
+		mag->page[mag->count++] = page;
+	}
+}
+
+/* Return the oldest count pages of the magazine to the bitsets */
+static void
+pmm_magazine_drain (struct pmm* pmm, struct pmm_magazine* mag, int count)
+{
+	mag->drains++;
+	sort_physical (mag->page, count);
+	pmm_bitmap_free_pages (pmm, mag->page, count);
+
+	mag->count -= count;
+	memmove (&mag->page[0], &mag->page[count],
+			 mag->count * sizeof(mag->page[0]));
+}
+
+/* Pop a page from the zeroed list, 0 if empty */
+static physical_t
+pmm_zeroed_pop (struct pmm* pmm)
+{
+	physical_t page = pmm->zeroed;
+	if (page == 0)
+		return 0;
+
+	physical_t* link = HHDM_POINTER (page);
+	pmm->zeroed = *link;
+	pmm->zeroed_count--;
+	*link = 0;
+	pmm_page (pmm, page)->flags = 0;
+	return page;
+}
+
+static void
+pmm_zeroed_push (struct pmm* pmm, physical_t page)
+{
+	*pmm_page (pmm, page) = (struct page) { .flags = PAGE_ZEROED };
+
+	physical_t* link = HHDM_POINTER (page);
+	*link = pmm->zeroed;
+	pmm->zeroed = page;
+	pmm->zeroed_count++;
+}
+
+/* Ask the shrinkers for up to pages pages, returns how many they freed.
+ * Only one CPU runs them at a time, others (and shrinkers that allocate)
+ * get 0 */
+static size_t
+pmm_shrink (struct pmm* pmm, size_t pages)
+{
+	if (__atomic_test_and_set (&pmm->shrinking, __ATOMIC_ACQUIRE))
+		return 0;
+
+	size_t freed = 0;
+	for ( struct pmm_shrinker* s = pmm->shrinkers;
+		  s && freed < pages; s = s->next )
+		freed += s->shrink (s->data, pages - freed);
+
+	pmm->reclaimed += freed;
+	__atomic_clear (&pmm->shrinking, __ATOMIC_RELEASE);
+	return freed;
+}
+
+physical_t
+pmm_allocate_page (struct pmm* pmm)
+{
+	do {
+		struct pmm_magazine* mag = pmm_magazine (pmm);
+		if (mag) {
+			if (mag->count) {
+				mag->hits++;
+				return mag->page[--mag->count];
+			}
+
+			mag->misses++;
+			pmm_magazine_refill (pmm, mag);
+			if (mag->count)
+				return mag->page[--mag->count];
+		}
+
+		// Clean pages work just as well
+		physical_t page = pmm_zeroed_pop (pmm);
+		if (page)
+			return page;
+
+		// Last resort, take pages back from the caches
+	} while (pmm_shrink (pmm, PMM_MAGAZINE_BATCH));
+
+	eprintf ("Warning: Physical allocation failure %p\n", pmm);
+	return 0;
+}
+
+size_t
+pmm_allocate_page_batch (struct pmm* pmm, physical_t* pages, size_t count)
+{
+	size_t n = 0;
+	struct pmm_magazine* mag = pmm_magazine (pmm);
+
+	// Shrinkers free into the magazine, so retries look there first too
+	do {
+		if (mag) {
+			size_t from = n;
+			while (n < count && mag->count)
+				pages[n++] = mag->page[--mag->count];
+			mag->hits += n - from;
+		}
+
+		n += pmm_bitmap_alloc_batch (pmm, pmm_hint (pmm), pages + n, count - n);
+
+		while (n < count) {
+			physical_t page = pmm_zeroed_pop (pmm);
+			if (page == 0)
+				break;
+			pages[n++] = page;
+		}
+	} while (n < count && pmm_shrink (pmm, count - n));
+
+	if (n < count)
+		eprintf ("Warning: Physical allocation failure %p (%zu of %zu)\n",
+				 pmm, n, count);
+	return n;
+}
+
+physical_t
+pmm_allocate_page_node (struct pmm* pmm, int node)
+{
+	assert (node >= 0 && node < PMM_NODES, "Bad node");
+
+	// Bypasses the magazines, which don't know where their pages live
+	for ( int k=0; k<PMM_NODES; k++ ) {
+		const int n = pmm->node_order[node][k];
+		for ( int i=-1; (i = pmm_summary_next_node (pmm, i, n)) >= 0; ) {
+			if (pmm_entry_take (pmm, i, 1))
+				return pmm_bitmap_alloc_entry (pmm, i, pmm_hint (pmm));
+		}
+	}
+
+	// Nothing left in the bitsets, take whatever is cached
+	return pmm_allocate_page (pmm);
+}
+
+physical_t
+pmm_allocate_zeroed_page (struct pmm* pmm)
+{
+	physical_t page = pmm_zeroed_pop (pmm);
+	if (page)
+		return page;
+
+	page = pmm_allocate_page (pmm);
+	if (page)
+		clear_page (HHDM_POINTER (page));
+	return page;
+}
+
+/* Panic unless physical is a page the pmm handed out and nobody has freed
+ * since: clear in the bitset, and not in this CPU's magazine or the zeroed
+ * pool */
+static void
+pmm_check_allocated (struct pmm* pmm, physical_t physical)
+{
+	int i = pmm_find_entry (pmm, physical);
+	struct pmm_ctrl_ptr* p = i < 0 ? NULL : pmm_entry (pmm, i);
+
+	if (!p || physical & (PAGE_SIZE - 1) || physical < pmm_ctrl_begin (p)
+		|| !__atomic_load_n (&p->is_initialised, __ATOMIC_ACQUIRE))
+		panic ("%s:%i %p Bad free (block %zx)\n",
+			   __FILE__, __LINE__, pmm, physical);
+
+	int idx = (physical - p->physical_start) / PAGE_SIZE;
+	uint64_t* bits = p->is_compact ? p->compact : p->ctrl->entry;
+	struct page* page = pmm_page (pmm, physical);
+
+	bool freed = (bit_word (&bits[idx / 64]) >> (idx % 64)) & 1
+				 || (page->flags & PAGE_ZEROED);
+
+	if (pmm->cpu) {
+		struct pmm_magazine* mag = &pmm->cpu->magazine[cpu_current_index ()];
+		for ( int m=0; m<mag->count; m++ )
+			freed |= mag->page[m] == physical;
+	}
+
+	if (freed)
+		panic ("%s:%i %p Double free (block %zx)\n",
+			   __FILE__, __LINE__, pmm, physical);
+}
+
+void
+pmm_free_zeroed_page (struct pmm* pmm, physical_t physical)
+{
+	if (physical == 0)
+		return;
+
+	pmm_check_allocated (pmm, physical);
+	pmm_zeroed_push (pmm, physical);
+}
+
+size_t
+pmm_refill_zeroed (struct pmm* pmm, size_t budget)
+{
+	size_t done = 0;
+
+	// Memory is needed more than clean pages
+	if (pmm->reclaim_wanted)
+		return 0;
+
+	for ( ; done < budget && pmm->zeroed_count < PMM_ZEROED_TARGET; done++ ) {
+		physical_t page = pmm_bitmap_alloc (pmm, pmm_hint (pmm));
+		if (page == 0)
+			break;
+
+		clear_page (HHDM_POINTER (page));
+		pmm_zeroed_push (pmm, page);
+	}
+
+	return done;
+}
+
+/* Give the whole zeroed list back to the bitsets */
+static void
+pmm_zeroed_drain (struct pmm* pmm)
+{
+	physical_t page;
+	while ((page = pmm_zeroed_pop (pmm)))
+		pmm_bitmap_free (pmm, page, 0);
+}
+
+void
+pmm_flush_cpu_cache (struct pmm* pmm)
+{
+	if (!pmm->cpu)
+		return;
+
+	struct pmm_magazine* mag = &pmm->cpu->magazine[cpu_current_index ()];
+	if (mag->count)
+		pmm_magazine_drain (pmm, mag, mag->count);
+}
+
+struct page*
+pmm_page (struct pmm* pmm, physical_t physical)
+{
+	int i = pmm_find_entry (pmm, physical);
+	if (i < 0)
+		return NULL;
+
+	// Pages of blocks never allocated from can't be in use anyway, but
+	// their db is only valid once touched
+	struct pmm_ctrl_ptr* p = pmm_entry (pmm, i);
+	pmm_ctrl_touch (p);
+
+	return pmm_ctrl_db (p) + (physical - pmm_ctrl_begin (p)) / PAGE_SIZE;
+}
+
+void
+page_get (struct pmm* pmm, physical_t physical)
+{
+	struct page* page = pmm_page (pmm, physical);
+	if (!page)
+		panic ("%s:%i %p Bad page reference (block %zx)\n",
+			   __FILE__, __LINE__, pmm, physical);
+
+	__atomic_add_fetch (&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+bool
+page_put (struct pmm* pmm, physical_t physical)
+{
+	struct page* page = pmm_page (pmm, physical);
+	if (!page)
+		panic ("%s:%i %p Bad page reference (block %zx)\n",
+			   __FILE__, __LINE__, pmm, physical);
+
+	uint32_t refs = __atomic_load_n (&page->refcount, __ATOMIC_RELAXED);
+	do {
+		if (refs == 0)
+			break;
+	} while (!__atomic_compare_exchange_n (&page->refcount, &refs, refs - 1,
+										   true, __ATOMIC_ACQ_REL,
+										   __ATOMIC_RELAXED));
+	if (refs)
+		return false;
+
+	// Last reference, the page is ours alone
+	page->flags = 0;
+	page->owner = NULL;
+	pmm_free_page (pmm, physical);
+	return true;
+}
+
+void
+pmm_register_shrinker (struct pmm* pmm, struct pmm_shrinker* shrinker)
+{
+	shrinker->next = pmm->shrinkers;
+	pmm->shrinkers = shrinker;
+}
+
+void
+pmm_unregister_shrinker (struct pmm* pmm, struct pmm_shrinker* shrinker)
+{
+	struct pmm_shrinker** link = &pmm->shrinkers;
+	while (*link && *link != shrinker)
+		link = &(*link)->next;
+
+	if (*link)
+		*link = shrinker->next;
+}
+
+void
+pmm_set_watermarks (struct pmm* pmm, size_t low, size_t high)
+{
+	assert (low <= high, "Low watermark above high");
+	pmm->watermark_low = low;
+	pmm->watermark_high = high;
+	pmm->reclaim_wanted = pmm->free_pages < low;
+}
+
+size_t
+pmm_reclaim (struct pmm* pmm, size_t budget)
+{
+	if (!pmm->reclaim_wanted)
+		return 0;
+
+	// Our own caches first, they cost nothing to refill
+	size_t before = pmm->free_pages;
+	pmm_flush_cpu_cache (pmm);
+	pmm_zeroed_drain (pmm);
+	size_t done = pmm->free_pages - before;
+
+	while (done < budget && pmm->free_pages < pmm->watermark_high) {
+		size_t want = MIN (budget - done, pmm->watermark_high - pmm->free_pages);
+		size_t freed = pmm_shrink (pmm, want);
+		if (freed == 0)
+			break;
+
+		// Shrinkers free pages into the magazine
+		pmm_flush_cpu_cache (pmm);
+		done += freed;
+	}
+
+	if (pmm->free_pages >= pmm->watermark_high)
+		pmm->reclaim_wanted = false;
+
+	return done;
+}
+
+physical_t
+pmm_allocate_pages (struct pmm* pmm, int order)
+{
+	if (order == 0)
+		return pmm_allocate_page (pmm);
+
+	assert (order > 0 && order <= PMM_MAX_ORDER, "Invalid allocation order");
+	const uint32_t count = 1U << order;
+
+	for ( int retry=0; retry<2; retry++ ) {
+		for ( int i=-1; (i = pmm_summary_next (pmm, i)) >= 0; ) {
+			if (!pmm_entry_take (pmm, i, count))
+				continue;
+
+			struct pmm_ctrl_ptr* p = pmm_entry (pmm, i);
+			int idx = pmm_ctrl_alloc_run (p, order);
+			if (idx >= 0)
+				return p->physical_start + PAGE_SIZE * idx;
+
+			// Enough pages, but no run of them
+			pmm_entry_give (pmm, i, count);
+		}
+
+		// Cached single pages may be splitting a run, give them back
+		pmm_flush_cpu_cache (pmm);
+		pmm_zeroed_drain (pmm);
+		if (retry == 0)
+			pmm_shrink (pmm, count);
+	}
+
+	eprintf ("Warning: Physical allocation failure %p (order %i)\n",
+			 pmm, order);
+	return 0;
+}
+
+/* Set the bits for a naturally aligned run in block p.
+ * Caller updates free counts */
+static void
+pmm_ctrl_free (struct pmm* pmm, struct pmm_ctrl_ptr* p,
+			   physical_t physical, int order)
+{
+	int pageindex = (physical - p->physical_start) / PAGE_SIZE;
+	int count = 1 << order;
+
+	// Nothing was ever allocated from here
+	if (!__atomic_load_n (&p->is_initialised, __ATOMIC_ACQUIRE))
+		panic ("%s:%i %p Bad free (block %zx)\n",
+			   __FILE__, __LINE__, pmm, physical);
+
+	uint64_t* bits = p->is_compact ? p->compact : p->ctrl->entry;
+
+	for ( int idx = pageindex; idx < pageindex + count; idx += 64 ) {
+		int entry = idx / 64;
+		uint64_t mask = bit_range_mask (idx % 64, MIN (count, 64));
+
+		if (bit_release (&bits[entry], mask))
+			panic ("%s:%i %p Double free (block %zx)\n",
+				__FILE__, __LINE__, pmm, physical);
+
+		if (!p->is_compact)
+			pmm_ctrl_update (p->ctrl, entry);
+	}
+}
+
+void
+pmm_free_page (struct pmm* pmm, physical_t physical)
+{
+	if (physical == 0)
+		return;
+
+	if (physical & (PAGE_SIZE - 1))
+		panic ("%s:%i %p Bad free (block %zx)\n",
+			   __FILE__, __LINE__, pmm, physical);
+
+	struct pmm_magazine* mag = pmm_magazine (pmm);
+	if (!mag)
+		return pmm_bitmap_free (pmm, physical, 0);
+
+	// Catches repeated frees while the page is still cached here. Others
+	// are caught by the bitsets once the magazine is drained
+	for ( int i=0; i<mag->count; i++ ) {
+		if (mag->page[i] == physical)
+			panic ("%s:%i %p Double free (block %zx)\n",
+				   __FILE__, __LINE__, pmm, physical);
+	}
+
+	if (mag->count == PMM_MAGAZINE_SIZE)
+		pmm_magazine_drain (pmm, mag, PMM_MAGAZINE_BATCH);
+
+	mag->page[mag->count++] = physical;
+}
+
+void
+pmm_free_pages_order (struct pmm* pmm, physical_t physical, int order)
+{
+	// Runs are always size aligned, anything else is the wrong order
+	if (order < 0 || order > PMM_MAX_ORDER
+		|| physical & ((PAGE_SIZE << order) - 1))
+		panic ("%s:%i %p Bad free (block %zx order %i)\n",
+			   __FILE__, __LINE__, pmm, physical, order);
+
+	if (order == 0)
+		return pmm_free_page (pmm, physical);
+
+	if (physical)
+		pmm_bitmap_free (pmm, physical, order);
+}
+
+static void
+pmm_bitmap_free (struct pmm* pmm, physical_t physical, int order)
+{
+	assert (order >= 0 && order <= PMM_MAX_ORDER, "Invalid allocation order");
+	const int count = 1 << order;
+
+	int i = pmm_find_entry (pmm, physical);
+	if (i < 0 || physical & (PAGE_SIZE * count - 1)
+		|| physical + PAGE_SIZE * count > pmm_ctrl_end (pmm_entry (pmm, i)))
+		panic ("%s:%i %p Bad free (block %zx)\n",
+			   __FILE__, __LINE__, pmm, physical);
+
+	pmm_ctrl_free (pmm, pmm_entry (pmm, i), physical, order);
+	pmm_entry_give (pmm, i, count);
+}
+
+/* In-place heapsort, so batch frees need no extra memory */
+static void
+sort_sift_down (physical_t* arr, size_t root, size_t count)
+{
+	for (;;) {
+		size_t child = 2 * root + 1;
+		if (child >= count)
+			return;
+		if (child + 1 < count && arr[child] < arr[child + 1])
+			child++;
+		if (arr[root] >= arr[child])
+			return;
+
+		physical_t tmp = arr[root];
+		arr[root] = arr[child];
+		arr[child] = tmp;
+		root = child;
+	}
+}
+
+static void
+sort_physical (physical_t* arr, size_t count)
+{
+	for (size_t i = count / 2; i --> 0; )
+		sort_sift_down (arr, i, count);
+
+	for (size_t end = count; end --> 1; ) {
+		physical_t tmp = arr[0];
+		arr[0] = arr[end];
+		arr[end] = tmp;
+		sort_sift_down (arr, 0, end);
+	}
+}
+
+static bool
+sorted_contains (const physical_t* arr, size_t count, physical_t page)
+{
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (arr[mid] < page)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < count && arr[lo] == page;
+}
+
+/* Give sorted pages back to the bitsets, skipping any 0s */
+static void
+pmm_bitmap_free_pages (struct pmm* pmm, physical_t* pages, size_t count)
+{
+	size_t n = 0;
+	while (n < count && pages[n] == 0)
+		n++;
+
+	while (n < count) {
+		int i = pmm_find_entry (pmm, pages[n]);
+		if (i < 0)
+			panic ("%s:%i %p Bad free (block %zx)\n",
+				   __FILE__, __LINE__, pmm, pages[n]);
+
+		struct pmm_ctrl_ptr* p = pmm_entry (pmm, i);
+		physical_t end = pmm_ctrl_end (p);
+		int freed = 0;
+
+		for ( ; n < count && pages[n] < end; n++, freed++) {
+			if (pages[n] & (PAGE_SIZE - 1) || pages[n] < pmm_ctrl_begin (p))
+				panic ("%s:%i %p Bad free (block %zx)\n",
+					   __FILE__, __LINE__, pmm, pages[n]);
+			pmm_ctrl_free (pmm, p, pages[n], 0);
+		}
+
+		pmm_entry_give (pmm, i, freed);
+	}
+}
+
+void
+pmm_free_pages (struct pmm* pmm, physical_t* pages, size_t count)
+{
+	sort_physical (pages, count);
+
+	// The bitsets can't see pages cached here, check them as
+	// pmm_free_page does
+	if (pmm->cpu) {
+		struct pmm_magazine* mag = &pmm->cpu->magazine[cpu_current_index ()];
+		for ( int i=0; i<mag->count; i++ ) {
+			if (sorted_contains (pages, count, mag->page[i]))
+				panic ("%s:%i %p Double free (block %zx)\n",
+					   __FILE__, __LINE__, pmm, mag->page[i]);
+		}
+	}
+
+	pmm_bitmap_free_pages (pmm, pages, count);
+}
+
+/* Buddy-style breakdown of free memory: count each free aligned run of
+ * 2^order pages at the largest order it fits in */
+static void
+pmm_ctrl_count_runs (const uint64_t* bits, int bit, int order,
+					 struct pmm_stat* stat)
+{
+	bool free = true;
+	for ( int idx = bit; idx < bit + (1 << order) && free; idx += 64 ) {
+		uint64_t mask = bit_range_mask (idx % 64, MIN (1 << order, 64));
+		free = (bits[idx / 64] & mask) == mask;
+	}
+
+	if (free) {
+		stat->free_order[order]++;
+	} else if (order > 0) {
+		pmm_ctrl_count_runs (bits, bit, order - 1, stat);
+		pmm_ctrl_count_runs (bits, bit + (1 << (order - 1)), order - 1, stat);
+	}
+}
+
+/* As pmm_ctrl_count_runs, for bits [bit, end) which are all free */
+static void
+pmm_count_range_runs (int bit, int end, struct pmm_stat* stat)
+{
+	while (bit < end) {
+		int order = __builtin_ctz (bit | PMM_RUN_ALIGN_PAGES);
+		while (bit + (1 << order) > end)
+			order--;
+
+		stat->free_order[order]++;
+		bit += 1 << order;
+	}
+}
+
+struct pmm_stat
+pmm_count_pages (struct pmm* pmm)
+{
+	struct pmm_stat stat = {
+		.total = 1 + pmm->tables + pmm->compact_pages,
+		.overhead = 1 + pmm->tables + pmm->compact_pages,
+	};
+
+	for ( int i=0; i<pmm->count; i++ ) {
+		struct pmm_ctrl_ptr* p = pmm_entry (pmm, i);
+		stat.free += p->free_pages;
+		stat.free_node[p->node] += p->free_pages;
+		stat.used += (p->max_pages - p->free_pages);
+		stat.total += p->max_pages + pmm_db_pages (p->max_pages);
+		stat.overhead += pmm_db_pages (p->max_pages);
+
+		if (!p->is_compact) {
+			stat.overhead++;
+			stat.total++;
+		}
+
+		if (p->free_pages == 0)
+			continue;
+
+		if (!p->is_initialised) {
+			pmm_count_range_runs (p->first, p->first + p->max_pages, &stat);
+			continue;
+		}
+
+		const uint64_t* bits = p->is_compact ? p->compact : p->ctrl->entry;
+		int order = p->is_compact ? 6 : PMM_MAX_ORDER;
+		int end = p->first + p->max_pages;
+
+		for ( int bit=0; bit < end; bit += 1 << order )
+			pmm_ctrl_count_runs (bits, bit, order, &stat);
+	}
+
+	if (pmm->cpu) {
+		// Cache page itself is overhead, cached pages are still free
+		stat.overhead++;
+		stat.used--;
+
+		for ( int i=0; i<CPU_MAX; i++ ) {
+			struct pmm_magazine* mag = &pmm->cpu->magazine[i];
+			stat.cached += mag->count;
+			stat.magazine_hits += mag->hits;
+			stat.magazine_misses += mag->misses;
+			stat.magazine_refills += mag->refills;
+			stat.magazine_drains += mag->drains;
+		}
+
+		stat.free += stat.cached;
+		stat.used -= stat.cached;
+	}
+
+	stat.reclaimed = pmm->reclaimed;
+	stat.reclaim_wanted = pmm->reclaim_wanted;
+
+	stat.zeroed = pmm->zeroed_count;
+	stat.free += stat.zeroed;
+	stat.used -= stat.zeroed;
 
 	return stat;
 }
@@ -15,21 +15,161 @@ pmm_t pmm_new (void* control_page);
 void pmm_add (pmm_t, physical_t start, size_t size);
 
 
+/* As pmm_add, for memory local to NUMA node (0 <= node < PMM_NODES) */
+#define PMM_NODES 8
+
+void pmm_add_node (pmm_t, physical_t start, size_t size, int node);
+
+
+/* Set the relative cost of node from accessing memory on node to, in ACPI
+ * SLIT units (10 = local). Defaults to 10 local and 20 remote */
+void pmm_set_node_distance (pmm_t, int from, int to, int distance);
+
+
 /* Request a physical 4K page from the allocator
  * Returns physical addr on success, 0 on failure */
 physical_t pmm_allocate_page (pmm_t);
 
 
-/* Free a single page previously allocated by pmm_allocate_page */
+/* Request count single pages into pages, returns the number allocated.
+ * Pages come from each bitset word many at a time */
+size_t pmm_allocate_page_batch (pmm_t, physical_t* pages, size_t count);
+
+
+/* Request a physical 4K page, preferably on node. Falls back to the other
+ * nodes nearest first, so the page is only remote if node is out of memory */
+physical_t pmm_allocate_page_node (pmm_t, int node);
+
+
+/* Request a physical 4K page filled with zeros.
+ * Comes from the pre-zeroed pool if possible, else is cleared here */
+physical_t pmm_allocate_zeroed_page (pmm_t);
+
+
+/* Return a page that is all zeros to the pre-zeroed pool. Panics if it
+ * isn't allocated from this pmm */
+void pmm_free_zeroed_page (pmm_t, physical_t phys);
+
+
+/* Clear up to budget free pages into the pre-zeroed pool, stopping once it
+ * holds PMM_ZEROED_TARGET pages (or at once while reclaim is wanted, see
+ * pmm_reclaim). Meant for idle time, returns pages cleared */
+#define PMM_ZEROED_TARGET 256
+
+size_t pmm_refill_zeroed (pmm_t, size_t budget);
+
+
+/* Return pages cached for the current CPU to the shared pool */
+void pmm_flush_cpu_cache (pmm_t);
+
+
+/* Request 2^order physically contiguous pages, aligned to their size.
+ * Returns physical addr on success, 0 on failure */
+#define PMM_MAX_ORDER 9
+
+physical_t pmm_allocate_pages (pmm_t, int order);
+
+
+/* Free a single page previously allocated by pmm_allocate_page.
+ * Pages that may have other references must use page_put instead */
 void pmm_free_page (pmm_t, physical_t phys);
 
 
+/* Free a run previously allocated by pmm_allocate_pages */
+void pmm_free_pages_order (pmm_t, physical_t phys, int order);
+
+
+/* Free count pages previously allocated by pmm_allocate_page.
+ * pages is sorted in place, so each control block is visited once */
+void pmm_free_pages (pmm_t, physical_t* pages, size_t count);
+
+
+/* Page frame database
+ *
+ * Every page the pmm manages has a struct page. refcount counts references
+ * besides the one from allocating it, so pages come out of the pmm at 0 and
+ * plain allocate/free never touch it. Pages with more than one user (shared
+ * mappings, copy on write) take references with page_get and drop them with
+ * page_put instead of freeing. owner and flags are free for the current
+ * user of the page; page_put clears them when it frees the page. Pages on
+ * the zeroed pool have no user, and only PAGE_ZEROED set */
+enum page_flags {
+	PAGE_COPY_ON_WRITE = 1 << 0,
+	PAGE_PINNED = 1 << 1, // Must not be moved or reclaimed
+	PAGE_ZEROED = 1 << 2, // In the pmm's zeroed pool
+};
+
+struct page {
+	uint32_t refcount;
+	uint32_t flags;
+	void* owner;
+};
+
+/* The struct page of an allocated page, NULL if not managed by the pmm */
+struct page* pmm_page (pmm_t, physical_t phys);
+
+/* Add a reference to an allocated page */
+void page_get (pmm_t, physical_t phys);
+
+/* Drop a reference, freeing the page if it was the last.
+ * Returns true if the page was freed */
+bool page_put (pmm_t, physical_t phys);
+
+
+/* Caches built on the pmm hand pages back through a shrinker when memory
+ * runs low. shrink should free up to pages pages and return how many it did.
+ * It can be called from inside an allocation (even one made by its own
+ * cache), so it must not allocate, and should give up rather than wait for
+ * a lock. The caller owns the storage until unregistered */
+struct pmm_shrinker {
+	size_t (*shrink) (void* data, size_t pages);
+	void* data;
+	struct pmm_shrinker* next;
+};
+
+void pmm_register_shrinker (pmm_t, struct pmm_shrinker*);
+void pmm_unregister_shrinker (pmm_t, struct pmm_shrinker*);
+
+
+/* Free pages below low flag the pmm for reclaim, which pmm_reclaim carries
+ * out until there are high free again. Both default to 0 (never) */
+void pmm_set_watermarks (pmm_t, size_t low, size_t high);
+
+
+/* If flagged for reclaim, return cached pages to the bitsets: this CPU's
+ * magazine, the zeroed pool, then the shrinkers for up to budget pages.
+ * Meant for idle time, so allocations rarely have to shrink caches
+ * themselves. Returns pages reclaimed */
+size_t pmm_reclaim (pmm_t, size_t budget);
+
+
 /* Returns usage info for the allocator */
 struct pmm_stat {
 	size_t free;
 	size_t total;
 	size_t used;
 	size_t overhead;
+
+	/* Free runs, counting each run once at the largest order it fits.
+	 * Excludes cached pages */
+	size_t free_order[PMM_MAX_ORDER + 1];
+
+	/* Per-CPU page cache. Cached pages are included in free */
+	size_t cached;
+	size_t magazine_hits;
+	size_t magazine_misses;
+	size_t magazine_refills;
+	size_t magazine_drains;
+
+	/* Pre-zeroed pool. Included in free */
+	size_t zeroed;
+
+	/* Pages given back by shrinkers so far */
+	size_t reclaimed;
+	bool reclaim_wanted;
+
+	/* Free pages in the bitsets of each node. Excludes cached pages */
+	size_t free_node[PMM_NODES];
 };
 struct pmm_stat pmm_count_pages (pmm_t);
 
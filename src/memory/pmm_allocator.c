@@ -0,0 +1,131 @@
+#include "pmm_allocator.h"
+#include "page.h"
+#include "pmm.h"
+#include "macros.h"
+
+static const struct allocator_vtbl pmm_allocator_vtbl;
+
+allocator_t
+pmm_allocator (pmm_t pmm)
+{
+	return (allocator_t) {
+		.self = pmm,
+		.vtbl = &pmm_allocator_vtbl,
+	};
+}
+
+static int
+size_order (size_t size)
+{
+	int order = 0;
+	while (((size_t)PAGE_SIZE << order) < size)
+		order++;
+	return order;
+}
+
+static struct blk
+pmm_allocator_alloc (void* self, size_t size)
+{
+	int order = size_order (size);
+	if (order > PMM_MAX_ORDER)
+		return (struct blk) {};
+
+	physical_t page = order ? pmm_allocate_pages (self, order)
+							: pmm_allocate_page (self);
+	if (page == 0)
+		return (struct blk) {};
+
+	return (struct blk) {
+		.ptr = HHDM_POINTER (page),
+		.size = (size_t)PAGE_SIZE << order,
+	};
+}
+
+static void
+pmm_allocator_free (void* self, struct blk blk)
+{
+	int order = size_order (blk.size);
+
+	if (order)
+		pmm_free_pages_order (self, HHDM_PHYSICAL (blk.ptr), order);
+	else
+		pmm_free_page (self, HHDM_PHYSICAL (blk.ptr));
+}
+
+static struct blk
+pmm_allocator_alloc_aligned (void* self, size_t size, size_t align)
+{
+	// Runs are aligned to their size
+	return pmm_allocator_alloc (self, MAX (size, align));
+}
+
+static size_t
+pmm_allocator_alloc_batch (void* self, size_t size, struct blk* mem,
+						   size_t count)
+{
+	if (size > PAGE_SIZE) {
+		size_t n = 0;
+		for ( ; n < count; n++)
+			if (!(mem[n] = pmm_allocator_alloc (self, size)).ptr)
+				break;
+		return n;
+	}
+
+	enum { CHUNK = 64 };
+	physical_t pages[CHUNK];
+	size_t n = 0;
+
+	while (n < count) {
+		size_t want = MIN (count - n, CHUNK);
+		size_t got = pmm_allocate_page_batch (self, pages, want);
+
+		for (size_t i=0; i<got; i++)
+			mem[n++] = (struct blk) { HHDM_POINTER (pages[i]), PAGE_SIZE };
+		if (got < want)
+			break;
+	}
+	return n;
+}
+
+static void
+pmm_allocator_free_batch (void* self, struct blk* mem, size_t count)
+{
+	enum { CHUNK = 64 };
+	physical_t pages[CHUNK];
+	int n = 0;
+
+	// Single pages are freed together, so each bitset is visited once
+	for (size_t i=0; i<count; i++) {
+		if (!mem[i].ptr)
+			continue;
+
+		if (size_order (mem[i].size)) {
+			pmm_allocator_free (self, mem[i]);
+			continue;
+		}
+
+		pages[n++] = HHDM_PHYSICAL (mem[i].ptr);
+		if (n == CHUNK) {
+			pmm_free_pages (self, pages, n);
+			n = 0;
+		}
+	}
+
+	pmm_free_pages (self, pages, n);
+}
+
+static void
+pmm_allocator_del (void* self)
+{
+	(void)self;
+}
+
+static const struct allocator_vtbl
+pmm_allocator_vtbl = {
+	.alloc = pmm_allocator_alloc,
+	.free = pmm_allocator_free,
+	.del = pmm_allocator_del,
+	.alloc_batch = pmm_allocator_alloc_batch,
+	.free_batch = pmm_allocator_free_batch,
+	.alloc_aligned = pmm_allocator_alloc_aligned,
+};
@@ -0,0 +1,14 @@
+#pragma once
+/*
+ * Allocator giving out whole runs of pages straight from the physical memory
+ * manager, as HHDM addresses. Sizes are rounded up to a power of two pages,
+ * and blocks are aligned to their size (as pmm_allocate_pages).
+ *
+ * Mostly a source of pages for other allocators.
+ */
+
+#include "allocator.h"
+
+struct pmm; // fwd
+
+allocator_t pmm_allocator (struct pmm*);
@@ -0,0 +1,320 @@
+#include "profiling_allocator.h"
+#include "types.h"
+#include "macros.h"
+#include "panic.h"
+#include "libk/kstdio.h"
+
+#include <stdint.h>
+
+#if PROFILE_ALLOC
+
+#define PROFILE_SITES 128
+#define PROFILE_BUCKETS 12 // 16, 32, ... 16K, bigger
+
+/* Sits just before each block handed out. offset is how far the block is from
+ * the inner allocation (more than the header for aligned blocks) */
+struct profile_header {
+	uint32_t site;
+	uint32_t offset;
+	uint64_t pad;
+};
+_Static_assert(sizeof(struct profile_header) == PROFILE_HEADER, "");
+
+struct profile_site {
+	void* address;
+	size_t allocations;
+	size_t frees;
+	size_t live;
+	size_t peak;
+	size_t sizes[PROFILE_BUCKETS];
+};
+
+struct profiler {
+	allocator_t inner;
+	struct blk self;
+	volatile bool lock;
+
+	size_t live;
+	size_t peak;
+
+	// sites[0] collects anything past the table filling up
+	struct profile_site sites[PROFILE_SITES];
+};
+
+static const struct allocator_vtbl profiler_vtbl;
+
+static inline void
+profiler_lock (struct profiler* prof)
+{
+	while (__atomic_test_and_set (&prof->lock, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n (&prof->lock, __ATOMIC_RELAXED))
+			;
+}
+
+static inline void
+profiler_unlock (struct profiler* prof)
+{
+	__atomic_clear (&prof->lock, __ATOMIC_RELEASE);
+}
+
+static inline void*
+call_site (void)
+{
+	return allocator_call_site[cpu_current_index ()];
+}
+
+static inline struct profile_header*
+header_of (void* ptr)
+{
+	return (struct profile_header*)ptr - 1;
+}
+
+static int
+size_bucket (size_t size)
+{
+	int bucket = 0;
+	while (bucket < PROFILE_BUCKETS - 1 && ((size_t)16 << bucket) < size)
+		bucket++;
+	return bucket;
+}
+
+/* Open addressing on the return address, caller holds the lock */
+static uint32_t
+site_index (struct profiler* prof, void* address)
+{
+	uintptr_t hash = (uintptr_t)address * 0x9e3779b97f4a7c15ull;
+	uint32_t start = 1 + (hash >> 32) % (PROFILE_SITES - 1);
+	uint32_t i = start;
+
+	do {
+		struct profile_site* site = &prof->sites[i];
+		if (site->address == address)
+			return i;
+		if (site->address == NULL) {
+			site->address = address;
+			return i;
+		}
+		i = i + 1 < PROFILE_SITES ? i + 1 : 1;
+	} while (i != start);
+
+	return 0;
+}
+
+static void
+note_alloc (struct profiler* prof, uint32_t index, size_t requested,
+			size_t size)
+{
+	struct profile_site* site = &prof->sites[index];
+
+	site->allocations++;
+	site->sizes[size_bucket (requested)]++;
+	site->live += size;
+	site->peak = MAX (site->peak, site->live);
+
+	prof->live += size;
+	prof->peak = MAX (prof->peak, prof->live);
+}
+
+static void
+note_free (struct profiler* prof, uint32_t index, size_t size)
+{
+	struct profile_site* site = &prof->sites[index];
+
+	site->frees++;
+	site->live -= size;
+	prof->live -= size;
+}
+
+/* Turn an inner allocation into one for the caller, recording it */
+static struct blk
+profiler_wrap (struct profiler* prof, void* address, struct blk blk,
+			   size_t requested, size_t offset)
+{
+	if (blk.ptr == NULL)
+		return (struct blk) {};
+
+	struct blk outer = {
+		.ptr = (char*)blk.ptr + offset,
+		.size = blk.size - offset,
+	};
+
+	profiler_lock (prof);
+	uint32_t index = site_index (prof, address);
+	note_alloc (prof, index, requested, outer.size);
+	profiler_unlock (prof);
+
+	*header_of (outer.ptr) = (struct profile_header) {
+		.site = index,
+		.offset = offset,
+	};
+	return outer;
+}
+
+static struct blk
+inner_of (struct blk blk)
+{
+	size_t offset = header_of (blk.ptr)->offset;
+	return (struct blk) {
+		.ptr = (char*)blk.ptr - offset,
+		.size = blk.size + offset,
+	};
+}
+
+static struct blk
+profiler_alloc (void* self, size_t size)
+{
+	struct profiler* prof = self;
+	void* address = call_site ();
+
+	struct blk blk = kalloc (prof->inner, size + PROFILE_HEADER);
+	return profiler_wrap (prof, address, blk, size, PROFILE_HEADER);
+}
+
+/* Each inner kalloc resets the call site, so the generic fallback won't do */
+static size_t
+profiler_alloc_batch (void* self, size_t size, struct blk* mem, size_t count)
+{
+	struct profiler* prof = self;
+	void* address = call_site ();
+
+	size_t n = 0;
+	for ( ; n < count; n++) {
+		struct blk blk = kalloc (prof->inner, size + PROFILE_HEADER);
+		blk = profiler_wrap (prof, address, blk, size, PROFILE_HEADER);
+		if (blk.ptr == NULL)
+			break;
+		mem[n] = blk;
+	}
+	return n;
+}
+
+static struct blk
+profiler_alloc_aligned (void* self, size_t size, size_t align)
+{
+	struct profiler* prof = self;
+	void* address = call_site ();
+
+	size_t offset = MAX (align, PROFILE_HEADER);
+	struct blk blk = kalloc_aligned (prof->inner, size + offset, align);
+	return profiler_wrap (prof, address, blk, size, offset);
+}
+
+static void
+profiler_free (void* self, struct blk blk)
+{
+	struct profiler* prof = self;
+
+	profiler_lock (prof);
+	note_free (prof, header_of (blk.ptr)->site, blk.size);
+	profiler_unlock (prof);
+
+	kfree (prof->inner, inner_of (blk));
+}
+
+/* Counted as a free from the old site and an allocation from this one */
+static struct blk
+profiler_realloc (void* self, struct blk blk, size_t size)
+{
+	struct profiler* prof = self;
+	void* address = call_site ();
+
+	size_t offset = header_of (blk.ptr)->offset;
+	uint32_t index = header_of (blk.ptr)->site;
+
+	struct blk moved = krealloc (prof->inner, inner_of (blk), size + offset);
+	if (moved.ptr == NULL)
+		return (struct blk) {};
+
+	profiler_lock (prof);
+	note_free (prof, index, blk.size);
+	profiler_unlock (prof);
+
+	return profiler_wrap (prof, address, moved, size, offset);
+}
+
+static void
+profiler_del (void* self)
+{
+	struct profiler* prof = self;
+	allocator_t inner = prof->inner;
+
+	kfree (inner, prof->self);
+	DELETE_IFACE (inner);
+}
+
+static const struct allocator_vtbl profiler_vtbl = {
+	.alloc = profiler_alloc,
+	.realloc = profiler_realloc,
+	.free = profiler_free,
+	.del = profiler_del,
+	.alloc_batch = profiler_alloc_batch,
+	.alloc_aligned = profiler_alloc_aligned,
+};
+
+allocator_t
+profiling_allocator_new (allocator_t inner)
+{
+	struct blk blk = kalloc (inner, sizeof (struct profiler));
+	if (blk.ptr == NULL)
+		return (allocator_t) {};
+
+	struct profiler* prof = blk.ptr;
+	*prof = (struct profiler) {
+		.inner = inner,
+		.self = blk,
+	};
+
+	return (allocator_t) {
+		.self = prof,
+		.vtbl = &profiler_vtbl,
+	};
+}
+
+void
+profiling_allocator_report (allocator_t profiler)
+{
+	assert (profiler.vtbl == &profiler_vtbl, "Not a profiling allocator");
+	struct profiler* prof = profiler.self;
+
+	struct profile_site* order[PROFILE_SITES];
+	int count = 0;
+
+	profiler_lock (prof);
+
+	// Insertion sort, most allocations first
+	for (int i=0; i<PROFILE_SITES; i++) {
+		struct profile_site* site = &prof->sites[i];
+		if (site->allocations == 0)
+			continue;
+
+		int j = count++;
+		for ( ; j > 0 && order[j-1]->allocations < site->allocations; j--)
+			order[j] = order[j-1];
+		order[j] = site;
+	}
+
+	printf ("alloc profile: %d sites live %zu peak %zu\n",
+			count, prof->live, prof->peak);
+	printf ("\tsite                 allocs      frees       live       peak\n");
+
+	for (int i=0; i<count; i++) {
+		struct profile_site* site = order[i];
+		printf ("\t%p %10zu %10zu %10zu %10zu\n", site->address,
+				site->allocations, site->frees, site->live, site->peak);
+
+		printf ("\t\t");
+		for (int b=0; b<PROFILE_BUCKETS; b++) {
+			if (site->sizes[b] == 0)
+				continue;
+			if (b == PROFILE_BUCKETS - 1)
+				printf (" >%zu:%zu", (size_t)16 << (b - 1), site->sizes[b]);
+			else
+				printf (" <=%zu:%zu", (size_t)16 << b, site->sizes[b]);
+		}
+		printf ("\n");
+	}
+
+	profiler_unlock (prof);
+}
+
+#endif
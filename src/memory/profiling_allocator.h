@@ -0,0 +1,48 @@
+#pragma once
+/*
+ * Allocation profiling.
+ *
+ * profiling_allocator_new wraps an allocator, forwarding every call to it and
+ * recording per call site (the caller of kalloc/krealloc/...): allocations,
+ * frees, live and peak bytes, and a histogram of sizes.
+ * profiling_allocator_report prints the busiest sites.
+ *
+ * Each block carries a small header in front, so inner allocations are
+ * PROFILE_HEADER bytes bigger than asked for.
+ *
+ * Only built with PROFILE_ALLOC=1 (see Makefile). Otherwise the wrapper is
+ * the inner allocator itself and call sites are not recorded, so there is no
+ * cost at all.
+ */
+
+#include "allocator.h"
+#include "drivers/cpu.h"
+
+#if PROFILE_ALLOC
+
+#define PROFILE_HEADER 16
+
+/* Set by the allocator.h wrappers to their return address, per CPU */
+extern void* allocator_call_site[CPU_MAX];
+
+/* Deleting the profiler also deletes inner */
+allocator_t profiling_allocator_new (allocator_t inner);
+
+/* Print stats for each call site seen, busiest first */
+void profiling_allocator_report (allocator_t profiler);
+
+#else
+
+static inline allocator_t
+profiling_allocator_new (allocator_t inner)
+{
+	return inner;
+}
+
+static inline void
+profiling_allocator_report (allocator_t profiler)
+{
+	(void)profiler;
+}
+
+#endif
@@ -0,0 +1,370 @@
+#include "slab.h"
+#include "types.h"
+#include "page.h"
+#include "panic.h"
+#include "macros.h"
+#include "drivers/cpu.h"
+
+#include <stdint.h>
+
+#define SLAB_MAX_ORDER 3
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_EMPTY_KEEP 2
+#define SLAB_COLOUR_STEP 64 // Cache line size
+
+#define SLAB_MAGAZINE_BATCH 8
+
+/* Header at the start of every slab. Free objects are linked through a
+ * pointer at link_offset of each object, untouched ones are handed out in
+ * order from index fresh */
+struct slab {
+	struct slab* next;
+	struct slab* prev;
+	char* objects;
+	void* free;
+	int used;
+	int fresh;
+	int list;
+};
+
+static const struct allocator_vtbl slab_vtbl;
+
+static inline void
+slab_lock (struct slab_cache* cache)
+{
+	while (__atomic_test_and_set (&cache->lock, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n (&cache->lock, __ATOMIC_RELAXED))
+			;
+}
+
+static inline void
+slab_unlock (struct slab_cache* cache)
+{
+	__atomic_clear (&cache->lock, __ATOMIC_RELEASE);
+}
+
+static inline void**
+object_link (struct slab_cache* cache, void* object)
+{
+	return (void**)((char*)object + cache->link_offset);
+}
+
+static inline struct slab*
+slab_of (struct slab_cache* cache, void* object)
+{
+	return (void*)((uintptr_t)object & ~(uintptr_t)(cache->slab_size - 1));
+}
+
+allocator_t
+slab_new_ctor (allocator_t pages, size_t object_size, size_t align,
+			   void (*ctor)(void* object))
+{
+	align = MAX (align, sizeof(void*));
+	assert ((align & (align - 1)) == 0 && align <= PAGE_SIZE,
+			"Bad slab alignment");
+
+	// Constructed objects must keep their contents while free, so the
+	// free list link goes after the object instead of over it
+	size_t link_offset = ctor ? ROUND_UP_P2 (object_size, sizeof(void*)) : 0;
+	size_t stride = ROUND_UP_P2 (MAX (object_size, link_offset + sizeof(void*)),
+								 align);
+	size_t first = ROUND_UP_P2 (sizeof(struct slab), align);
+
+	int order = 0;
+	while (order < SLAB_MAX_ORDER
+		   && (((size_t)PAGE_SIZE << order) - first) / stride < SLAB_MIN_OBJECTS)
+		order++;
+
+	size_t slab_size = (size_t)PAGE_SIZE << order;
+	if (slab_size < first + stride)
+		return (allocator_t) {};
+
+	struct blk blk = kalloc (pages, sizeof(struct slab_cache));
+	if (!blk.ptr)
+		return (allocator_t) {};
+
+	struct slab_cache* cache = blk.ptr;
+	*cache = (struct slab_cache) {
+		.pages = pages,
+		.ctor = ctor,
+		.object_size = object_size,
+		.stride = stride,
+		.link_offset = link_offset,
+		.slab_size = slab_size,
+		.first = first,
+		.per_slab = (slab_size - first) / stride,
+		.colour_step = MAX (align, SLAB_COLOUR_STEP),
+	};
+
+	cache->colour_max = slab_size - first - cache->per_slab * stride;
+
+	return (allocator_t) {
+		.self = cache,
+		.vtbl = &slab_vtbl,
+	};
+}
+
+allocator_t
+slab_new (allocator_t pages, size_t object_size, size_t align)
+{
+	return slab_new_ctor (pages, object_size, align, NULL);
+}
+
+/* Slab lists, called with the lock held */
+
+static void
+list_move (struct slab_cache* cache, struct slab* slab, int to)
+{
+	if (slab->list >= 0) {
+		if (slab->prev)
+			slab->prev->next = slab->next;
+		else
+			cache->list[slab->list] = slab->next;
+
+		if (slab->next)
+			slab->next->prev = slab->prev;
+		cache->list_count[slab->list]--;
+	}
+
+	slab->list = to;
+	if (to < 0)
+		return;
+
+	slab->prev = NULL;
+	slab->next = cache->list[to];
+	if (slab->next)
+		slab->next->prev = slab;
+	cache->list[to] = slab;
+	cache->list_count[to]++;
+}
+
+static struct slab*
+slab_grow (struct slab_cache* cache)
+{
+	struct blk blk = kalloc (cache->pages, cache->slab_size);
+	if (!blk.ptr)
+		return NULL;
+
+	assert (((uintptr_t)blk.ptr & (cache->slab_size - 1)) == 0,
+			"Slab pages not aligned to their size");
+
+	struct slab* slab = blk.ptr;
+	*slab = (struct slab) {
+		.objects = (char*)slab + cache->first + cache->colour_next,
+		.list = -1,
+	};
+
+	cache->colour_next += cache->colour_step;
+	if (cache->colour_next > cache->colour_max)
+		cache->colour_next = 0;
+
+	list_move (cache, slab, SLAB_EMPTY);
+	return slab;
+}
+
+static void
+slab_release (struct slab_cache* cache, struct slab* slab)
+{
+	list_move (cache, slab, -1);
+	kfree (cache->pages, (struct blk) { slab, cache->slab_size });
+}
+
+static void*
+slab_take (struct slab_cache* cache)
+{
+	struct slab* slab = cache->list[SLAB_PARTIAL];
+	if (!slab)
+		slab = cache->list[SLAB_EMPTY];
+	if (!slab)
+		slab = slab_grow (cache);
+	if (!slab)
+		return NULL;
+
+	void* object;
+	if (slab->free) {
+		object = slab->free;
+		slab->free = *object_link (cache, object);
+	} else {
+		object = slab->objects + slab->fresh++ * cache->stride;
+		if (cache->ctor)
+			cache->ctor (object);
+	}
+
+	slab->used++;
+	list_move (cache, slab, slab->used == cache->per_slab ? SLAB_FULL
+														: SLAB_PARTIAL);
+	return object;
+}
+
+static void
+slab_put (struct slab_cache* cache, void* object)
+{
+	struct slab* slab = slab_of (cache, object);
+
+	*object_link (cache, object) = slab->free;
+	slab->free = object;
+	slab->used--;
+
+	if (slab->used > 0) {
+		if (slab->list != SLAB_PARTIAL)
+			list_move (cache, slab, SLAB_PARTIAL);
+	} else if (cache->list_count[SLAB_EMPTY] < SLAB_EMPTY_KEEP) {
+		list_move (cache, slab, SLAB_EMPTY);
+	} else {
+		slab_release (cache, slab);
+	}
+}
+
+/* Magazines */
+
+static void
+magazine_refill (struct slab_cache* cache, struct slab_magazine* mag)
+{
+	slab_lock (cache);
+	while (mag->count < SLAB_MAGAZINE_BATCH) {
+		void* object = slab_take (cache);
+		if (!object)
+			break;
+		mag->object[mag->count++] = object;
+	}
+	slab_unlock (cache);
+}
+
+static void
+magazine_drain (struct slab_cache* cache, struct slab_magazine* mag, int count)
+{
+	slab_lock (cache);
+	for (int i=0; i<count; i++)
+		slab_put (cache, mag->object[--mag->count]);
+	slab_unlock (cache);
+}
+
+static struct blk
+slab_alloc (void* self, size_t size)
+{
+	struct slab_cache* cache = self;
+
+	if (size > cache->object_size)
+		return (struct blk) {};
+
+	struct slab_magazine* mag = &cache->magazine[cpu_current_index ()];
+	if (mag->count == 0)
+		magazine_refill (cache, mag);
+	if (mag->count == 0)
+		return (struct blk) {};
+
+	return (struct blk) {
+		.ptr = mag->object[--mag->count],
+		.size = cache->object_size,
+	};
+}
+
+static void
+slab_free (void* self, struct blk blk)
+{
+	struct slab_cache* cache = self;
+
+	struct slab_magazine* mag = &cache->magazine[cpu_current_index ()];
+	if (mag->count == SLAB_MAGAZINE_SIZE)
+		magazine_drain (cache, mag, SLAB_MAGAZINE_BATCH);
+
+	mag->object[mag->count++] = blk.ptr;
+}
+
+slab_t
+slab_cache_of (allocator_t alloc)
+{
+	assert (alloc.vtbl == &slab_vtbl, "Not a slab allocator");
+	return alloc.self;
+}
+
+struct blk
+slab_cache_alloc_slow (slab_t cache, size_t size)
+{
+	if (size == 0)
+		return (struct blk) {};
+	return slab_alloc (cache, size);
+}
+
+void
+slab_cache_free_slow (slab_t cache, struct blk blk)
+{
+	if (blk.ptr)
+		slab_free (cache, blk);
+}
+
+size_t
+slab_shrink (allocator_t alloc)
+{
+	struct slab_cache* cache = slab_cache_of (alloc);
+
+	struct slab_magazine* mag = &cache->magazine[cpu_current_index ()];
+	magazine_drain (cache, mag, mag->count);
+
+	size_t released = 0;
+	slab_lock (cache);
+	while (cache->list[SLAB_EMPTY]) {
+		slab_release (cache, cache->list[SLAB_EMPTY]);
+		released += cache->slab_size;
+	}
+	slab_unlock (cache);
+
+	return released;
+}
+
+/* Called by the pmm, maybe from inside slab_grow, so never waits for the
+ * lock */
+static size_t
+slab_shrink_pages (void* data, size_t pages)
+{
+	struct slab_cache* cache = data;
+	const size_t slab_pages = cache->slab_size / PAGE_SIZE;
+
+	if (__atomic_test_and_set (&cache->lock, __ATOMIC_ACQUIRE))
+		return 0;
+
+	size_t released = 0;
+	while (released < pages && cache->list[SLAB_EMPTY]) {
+		slab_release (cache, cache->list[SLAB_EMPTY]);
+		released += slab_pages;
+	}
+	slab_unlock (cache);
+
+	return released;
+}
+
+void
+slab_register_shrinker (allocator_t alloc, pmm_t pmm)
+{
+	struct slab_cache* cache = slab_cache_of (alloc);
+	assert (!cache->shrinker_pmm, "Slab shrinker already registered");
+
+	cache->shrinker = (struct pmm_shrinker) {
+		.shrink = slab_shrink_pages,
+		.data = cache,
+	};
+	cache->shrinker_pmm = pmm;
+	pmm_register_shrinker (pmm, &cache->shrinker);
+}
+
+static void
+slab_del (void* self)
+{
+	struct slab_cache* cache = self;
+
+	if (cache->shrinker_pmm)
+		pmm_unregister_shrinker (cache->shrinker_pmm, &cache->shrinker);
+
+	for (int l=0; l<SLAB_LISTS; l++)
+		while (cache->list[l])
+			slab_release (cache, cache->list[l]);
+
+	kfree (cache->pages, (struct blk) { cache, sizeof(*cache) });
+}
+
+static const struct allocator_vtbl
+slab_vtbl = {
+	.alloc = slab_alloc,
+	.free = slab_free,
+	.del = slab_del,
+};
@@ -0,0 +1,122 @@
+#pragma once
+/*
+ * Slab allocator for objects of one size (kmem_cache style).
+ *
+ * Objects are carved out of slabs, naturally aligned runs of pages from the
+ * given allocator (e.g. pmm_allocator). Slabs sit on full, partial and empty
+ * lists; a few empty slabs are kept, the rest go back to the page allocator.
+ * The start of each new slab is offset by a different multiple of the cache
+ * line size (colour), so equal objects of different slabs don't all compete
+ * for the same cache sets.
+ *
+ * Each CPU keeps a small magazine of free objects, so most allocations and
+ * frees don't touch the shared slab lists (or their lock).
+ *
+ * Allocations of up to object_size bytes are accepted, larger ones fail.
+ */
+
+#include "allocator.h"
+#include "types.h"
+#include "pmm.h"
+#include "drivers/cpu.h"
+
+/* Create a cache of object_size byte objects, each aligned to align (a power
+ * of two, at most a page). pages must return blocks aligned to their size for
+ * power of two multiples of PAGE_SIZE. Returns a null allocator on failure */
+allocator_t slab_new (allocator_t pages, size_t object_size, size_t align);
+
+/* As slab_new, with ctor called on each object before it is first handed
+ * out. Objects stay constructed: free must return them in that state */
+allocator_t slab_new_ctor (allocator_t pages, size_t object_size, size_t align,
+						   void (*ctor)(void* object));
+
+/* Give the current CPU's cached objects and all empty slabs back to the page
+ * allocator, e.g. when memory runs low. Returns bytes released */
+size_t slab_shrink (allocator_t slab);
+
+/* Have pmm release empty slabs of this cache when it runs low on memory.
+ * Deleting the slab unregisters it */
+void slab_register_shrinker (allocator_t slab, pmm_t pmm);
+
+
+/* Static fast path
+ *
+ * Code that knows it has a slab can skip the vtable: slab_cache_alloc and
+ * slab_cache_free are inlined down to a push or pop of the CPU's magazine,
+ * only calling out when it is empty (or full) */
+#define SLAB_MAGAZINE_SIZE 15
+
+enum slab_list {
+	SLAB_FULL,
+	SLAB_PARTIAL,
+	SLAB_EMPTY,
+	SLAB_LISTS,
+};
+
+struct slab_magazine {
+	int count;
+	void* object[SLAB_MAGAZINE_SIZE];
+} __attribute__((aligned(64)));
+
+struct slab;
+
+struct slab_cache {
+	allocator_t pages;
+	void (*ctor)(void*);
+
+	size_t object_size;
+	size_t stride;
+	size_t link_offset;
+	size_t slab_size;
+	size_t first; // Offset of the first object, before colouring
+	int per_slab;
+
+	size_t colour_max;
+	size_t colour_step;
+	size_t colour_next;
+
+	// Protects everything below
+	bool lock;
+	struct slab* list[SLAB_LISTS];
+	int list_count[SLAB_LISTS];
+
+	struct slab_magazine magazine[CPU_MAX];
+
+	struct pmm_shrinker shrinker;
+	pmm_t shrinker_pmm;
+};
+
+typedef struct slab_cache* slab_t;
+
+/* The cache behind an allocator from slab_new */
+slab_t slab_cache_of (allocator_t slab);
+
+struct blk slab_cache_alloc_slow (slab_t, size_t size);
+void slab_cache_free_slow (slab_t, struct blk mem);
+
+static inline struct blk
+slab_cache_alloc (slab_t cache, size_t size)
+{
+	struct slab_magazine* mag = &cache->magazine[cpu_current_index ()];
+
+	if (size == 0 || size > cache->object_size || mag->count == 0)
+		return slab_cache_alloc_slow (cache, size);
+
+	return (struct blk) {
+		.ptr = mag->object[--mag->count],
+		.size = cache->object_size,
+	};
+}
+
+static inline void
+slab_cache_free (slab_t cache, struct blk mem)
+{
+	struct slab_magazine* mag = &cache->magazine[cpu_current_index ()];
+
+	if (!mem.ptr || mag->count == SLAB_MAGAZINE_SIZE) {
+		slab_cache_free_slow (cache, mem);
+		return;
+	}
+
+	mag->object[mag->count++] = mem.ptr;
+}
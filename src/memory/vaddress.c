@@ -3,57 +3,83 @@
 #include "panic.h"
 
 #include "pmm.h"
+#include "object_cache.h"
+#include "drivers/mmu.h"
 #include <string.h>
 #include "libk/kstdio.h"
-
-#define REGIONS_PER_BLOCK 100
+#include "macros.h"
 
 /* vaddress_space manages a virtual address space
- * Uses a linked list of address_region for each used region of memory
+ * Used regions of memory are kept in an AVL tree keyed by address, and
+ * threaded in address order through prev/next. Adjacent allocations are
+ * merged into one region.
+ *
+ * Each node also stores the largest free gap in its subtree, where the gap
+ * of a node is the free space just below it. First-fit allocation descends
+ * towards the lowest gap that is big enough, so allocate and free are both
+ * O(log n) in the number of regions.
+ *
+ * Regions made by vaddress_reserve record how to back them. Zero-fill
+ * regions get pages mapped one at a time by vaddress_fault, on first touch,
+ * and hand them back when freed.
  *
- * Storage for linked_list backed by storage_blocks
+ * Space headers and nodes come from one object cache shared by every space,
+ * so a small space costs a few objects rather than whole pages.
  */
 
 struct address_region {
-	struct address_region* next;
-	//struct address_region* prev;
+	struct address_region* next; // Next region up
+	struct address_region* prev;
+
+	struct address_region* parent;
+	struct address_region* left;
+	struct address_region* right;
+	int height;
+	uint8_t flags; // enum mmu_flags for demand filled pages
+	uint8_t backing; // enum vaddress_backing
+
+	size_t max_gap; // Largest gap of any node in this subtree
 	void* begin;
 	void* end;
 };
 
-struct storage_block {
-	struct storage_block* next;
-	int entries;
-	struct address_region entry[REGIONS_PER_BLOCK];
-} PAGE_ALIGNED;
-
-REQUIRE_PAGE_SIZED(struct storage_block);
-
 struct vaddress_space {
-	struct storage_block* storage;
 	struct pmm* pmm;
 
-	struct address_region* allocated;
-	struct address_region* unused;
+	struct address_region* root;
+	int nodes;
 
 	void* space_begin;
 	void* space_end;
+
+	// Requests aligned to at least large_align go above large_split
+	void* large_split;
+	size_t large_align;
 };
 
-inline static void*
-new_page (struct pmm* pmm)
+// Big enough for either a space header or a node
+#define VADDRESS_OBJECT_SIZE \
+	MAX (sizeof(struct vaddress_space), sizeof(struct address_region))
+
+static struct object_cache vaddress_cache;
+
+static void*
+new_object (struct pmm* pmm)
 {
-	uint64_t phys = pmm_allocate_page (pmm);
-	assert (phys, "Vaddress allocation failed");
-	return HHDM_POINTER (phys);
+	if (!vaddress_cache.pmm)
+		object_cache_initialise (&vaddress_cache, pmm, VADDRESS_OBJECT_SIZE);
+
+	assert (vaddress_cache.pmm == pmm, "Vaddress spaces must share a pmm");
+
+	void* object = object_cache_alloc (&vaddress_cache);
+	assert (object, "Vaddress allocation failed");
+	return object;
 }
 
 struct vaddress_space*
 vaddress_space_new (struct pmm* pmm, void* begin, void* end)
 {
-	// Yes, this wastes a page of ram.
-	// We don't yet have a sup-page allocator :(
-	struct vaddress_space* vaddr = new_page (pmm);
+	struct vaddress_space* vaddr = new_object (pmm);
 	*vaddr = (struct vaddress_space) {
 		.pmm = pmm,
 		.space_begin = begin,
@@ -66,158 +92,598 @@ vaddress_space_new (struct pmm* pmm, void* begin, void* end)
 static struct address_region*
 find_free_node (struct vaddress_space* vaddr)
 {
-	struct address_region* node = vaddr->unused;
-	struct storage_block* blk = vaddr->storage;
+	struct address_region* node = new_object (vaddr->pmm);
+	vaddr->nodes++;
+	return memset (node, 0, sizeof(*node));
+}
+
+static void
+release_node (struct vaddress_space* vaddr, struct address_region* node)
+{
+	object_cache_free (&vaddress_cache, node);
+	vaddr->nodes--;
+}
+
+
+/* Tree helpers */
+
+/* Free space between a region and the one below it */
+static inline size_t
+region_gap (struct vaddress_space* vaddr, const struct address_region* node)
+{
+	return node->begin - (node->prev ? node->prev->end : vaddr->space_begin);
+}
+
+static inline int
+region_height (const struct address_region* node)
+{
+	return node ? node->height : 0;
+}
 
-	if (node) {
-		// Pop from free list
-		vaddr->unused = node->next;
-		goto found;
+static inline size_t
+region_max_gap (const struct address_region* node)
+{
+	return node ? node->max_gap : 0;
+}
+
+/* Recompute cached values of node from its children */
+static void
+region_update (struct vaddress_space* vaddr, struct address_region* node)
+{
+	node->height = 1 + MAX (region_height (node->left),
+							region_height (node->right));
+	node->max_gap = MAX (region_gap (vaddr, node),
+						 MAX (region_max_gap (node->left),
+							  region_max_gap (node->right)));
+}
+
+/* Point whatever referred to old (parent or root) at new */
+static void
+region_replace_child (struct vaddress_space* vaddr,
+					  struct address_region* old, struct address_region* new)
+{
+	struct address_region* parent = old->parent;
+
+	if (!parent)
+		vaddr->root = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+
+	if (new)
+		new->parent = parent;
+}
+
+/* Rotations return the new subtree root */
+static struct address_region*
+region_rotate_left (struct vaddress_space* vaddr, struct address_region* node)
+{
+	struct address_region* top = node->right;
+
+	region_replace_child (vaddr, node, top);
+	node->right = top->left;
+	if (node->right)
+		node->right->parent = node;
+	top->left = node;
+	node->parent = top;
+
+	region_update (vaddr, node);
+	region_update (vaddr, top);
+	return top;
+}
+
+static struct address_region*
+region_rotate_right (struct vaddress_space* vaddr, struct address_region* node)
+{
+	struct address_region* top = node->left;
+
+	region_replace_child (vaddr, node, top);
+	node->left = top->right;
+	if (node->left)
+		node->left->parent = node;
+	top->right = node;
+	node->parent = top;
+
+	region_update (vaddr, node);
+	region_update (vaddr, top);
+	return top;
+}
+
+/* Bring node and its ancestors up to date after a change below or to
+ * them, rebalancing on the way to the root */
+static void
+region_fixup (struct vaddress_space* vaddr, struct address_region* node)
+{
+	while (node) {
+		region_update (vaddr, node);
+		int balance = region_height (node->left) - region_height (node->right);
+
+		if (balance > 1) {
+			if (region_height (node->left->left) < region_height (node->left->right))
+				region_rotate_left (vaddr, node->left);
+			node = region_rotate_right (vaddr, node);
+		} else if (balance < -1) {
+			if (region_height (node->right->right) < region_height (node->right->left))
+				region_rotate_right (vaddr, node->right);
+			node = region_rotate_left (vaddr, node);
+		}
+
+		node = node->parent;
 	}
+}
 
-	for ( ; blk; blk = blk->next ) {
-		// Find block with unused entries
-		if (blk->entries < REGIONS_PER_BLOCK) {
-			node = &blk->entry[blk->entries];
-			blk->entries++;
-			goto found;
+/* A region's bounds changed, so its own gap and the next one may have */
+static void
+region_changed (struct vaddress_space* vaddr, struct address_region* node)
+{
+	region_fixup (vaddr, node);
+	if (node->next)
+		region_fixup (vaddr, node->next);
+}
+
+static struct address_region*
+region_insert (struct vaddress_space* vaddr, void* begin, void* end)
+{
+	struct address_region* node = find_free_node (vaddr);
+	node->begin = begin;
+	node->end = end;
+	node->height = 1;
+
+	struct address_region** link = &vaddr->root;
+	struct address_region* parent = NULL;
+	struct address_region* prev = NULL;
+	struct address_region* next = NULL;
+
+	while (*link) {
+		parent = *link;
+		if (begin < parent->begin) {
+			next = parent;
+			link = &parent->left;
+		} else {
+			prev = parent;
+			link = &parent->right;
 		}
 	}
 
-	// No space, allocate
-	blk = new_page (vaddr->pmm);
+	*link = node;
+	node->parent = parent;
 
-	blk->next = vaddr->storage;
-	vaddr->storage = blk;
+	node->prev = prev;
+	node->next = next;
+	if (prev)
+		prev->next = node;
+	if (next)
+		next->prev = node;
 
-	blk->entries = 1;
-	node = &blk->entry[0];
-found:
-	return memset (node, 0, sizeof(*node));
+	region_changed (vaddr, node);
+	return node;
 }
 
-void*
-vaddress_allocate (struct vaddress_space* vaddr, size_t size)
+/* Returns the region that follows the erased one, or NULL */
+static struct address_region*
+region_erase (struct vaddress_space* vaddr, struct address_region* node)
 {
-	struct address_region* next = vaddr->allocated;
+	struct address_region* next = node->next;
+
+	if (node->left && node->right) {
+		// Node takes over its successor's region, the successor goes instead
+		node->begin = next->begin;
+		node->end = next->end;
+		node->flags = next->flags;
+		node->backing = next->backing;
+		region_erase (vaddr, next);
+		return node;
+	}
 
-	void* free_begin = vaddr->space_begin;
-	void* free_end = next ? next->begin : vaddr->space_end;
-	size_t space = free_end - free_begin;
+	struct address_region* child = node->left ? node->left : node->right;
+	struct address_region* parent = node->parent;
+	region_replace_child (vaddr, node, child);
 
-	if ( space >= size ) {
-		struct address_region* region = find_free_node (vaddr);
-		// Push head
-		region->begin = free_begin;
-		region->end = free_begin + size;
-		region->next = vaddr->allocated;
-		vaddr->allocated = region;
-		return free_begin;
+	if (node->prev)
+		node->prev->next = next;
+	if (next)
+		next->prev = node->prev;
+
+	region_fixup (vaddr, parent);
+	if (node->prev)
+		region_fixup (vaddr, node->prev);
+	if (next)
+		region_fixup (vaddr, next);
+
+	release_node (vaddr, node);
+	return next;
+}
+
+static struct address_region*
+region_first (struct vaddress_space* vaddr)
+{
+	struct address_region* node = vaddr->root;
+	while (node && node->left)
+		node = node->left;
+	return node;
+}
+
+static struct address_region*
+region_last (struct vaddress_space* vaddr)
+{
+	struct address_region* node = vaddr->root;
+	while (node && node->right)
+		node = node->right;
+	return node;
+}
+
+static void region_release (struct vaddress_space*,
+							const struct address_region*, void*, void*);
+
+void
+vaddress_space_free (struct vaddress_space* vaddr)
+{
+	struct address_region* node = region_first (vaddr);
+	while (node) {
+		struct address_region* next = node->next;
+		region_release (vaddr, node, node->begin, node->end);
+		release_node (vaddr, node);
+		node = next;
 	}
 
-	struct address_region* allocated = vaddr->allocated;
-
-	while ( allocated ) {
-		next = allocated->next;
-		free_begin = allocated->end;
-		free_end = next ? next->begin : vaddr->space_end;
-		space = free_end - free_begin;
-		if ( space >= size ) {
-			// Extend
-			allocated->end += size;
-			return free_begin;
+	object_cache_free (&vaddress_cache, vaddr);
+}
+
+/* An allocation, to be placed within [lo, hi) of the space */
+struct vaddress_request {
+	size_t size;
+	size_t align;
+	void* lo;
+	void* hi;
+	enum mmu_flags flags;
+	enum vaddress_backing backing;
+};
+
+/* Neighbouring allocations only merge if they are the same kind */
+static inline bool
+region_is_like (const struct address_region* node,
+				const struct vaddress_request* req)
+{
+	return node->flags == req->flags && node->backing == req->backing;
+}
+
+/* Aligned start for the request in free space [begin, end), or NULL if it
+ * does not fit */
+static void*
+gap_fit (void* begin, void* end, const struct vaddress_request* req)
+{
+	uintptr_t lo = (uintptr_t)MAX (begin, req->lo);
+	uintptr_t hi = (uintptr_t)MIN (end, req->hi);
+	uintptr_t start = ROUND_UP_P2 (lo, req->align);
+
+	if (start < lo || start > hi || hi - start < req->size)
+		return NULL;
+	return (void*)start;
+}
+
+/* Lowest region of the subtree whose gap fits the request, or NULL.
+ * *start is set to where in the gap the allocation goes.
+ *
+ * Subtrees without a big enough gap, or entirely outside [lo, hi), are
+ * skipped. Without alignment any gap big enough fits, so this only
+ * descends one path. Aligned requests may also visit gaps that are big
+ * enough but not once aligned */
+static struct address_region*
+region_find_fit (struct vaddress_space* vaddr, struct address_region* node,
+				 const struct vaddress_request* req, void** start)
+{
+	if (region_max_gap (node) < req->size)
+		return NULL;
+
+	if (node->begin > req->lo) {
+		struct address_region* found = region_find_fit (vaddr, node->left,
+														req, start);
+		if (found)
+			return found;
+	}
+
+	void* below = node->prev ? node->prev->end : vaddr->space_begin;
+	if ((*start = gap_fit (below, node->begin, req)))
+		return node;
+
+	if (node->end >= req->hi)
+		return NULL;
+	return region_find_fit (vaddr, node->right, req, start);
+}
+
+/* First region ending after address, or NULL */
+static struct address_region*
+region_find_end_above (struct vaddress_space* vaddr, void* address)
+{
+	struct address_region* node = vaddr->root;
+	struct address_region* found = NULL;
+
+	while (node) {
+		if (node->end > address) {
+			found = node;
+			node = node->left;
+		} else {
+			node = node->right;
 		}
-		allocated = next;
 	}
 
-	return NULL;
+	return found;
+}
+
+
+/* Mark [start, start + req->size) used, in the gap below next (or at the
+ * top of the space if next is NULL) */
+static void
+region_place (struct vaddress_space* vaddr, struct address_region* next,
+			  void* start, const struct vaddress_request* req)
+{
+	struct address_region* prev = next ? next->prev : region_last (vaddr);
+	void* end = start + req->size;
+
+	bool merge_prev = prev && prev->end == start && region_is_like (prev, req);
+	bool merge_next = next && end == next->begin && region_is_like (next, req);
+
+	if (merge_prev) {
+		// Extend
+		prev->end = end;
+		if (merge_next) {
+			// Gap closed, merge with region above
+			prev->end = next->end;
+			region_erase (vaddr, next);
+		}
+		region_changed (vaddr, prev);
+	} else if (merge_next) {
+		next->begin = start;
+		region_changed (vaddr, next);
+	} else {
+		struct address_region* node = region_insert (vaddr, start, end);
+		node->flags = req->flags;
+		node->backing = req->backing;
+	}
+}
+
+static void*
+vaddress_allocate_in (struct vaddress_space* vaddr,
+					  const struct vaddress_request* req)
+{
+	void* start;
+	struct address_region* next = region_find_fit (vaddr, vaddr->root,
+												   req, &start);
+	if (!next) {
+		// Above the last region
+		struct address_region* last = region_last (vaddr);
+		start = gap_fit (last ? last->end : vaddr->space_begin,
+						 vaddr->space_end, req);
+		if (!start)
+			return NULL;
+	}
+
+	region_place (vaddr, next, start, req);
+	return start;
+}
+
+/* Find room for req anywhere in the space, minding the large/small split */
+static void*
+region_allocate (struct vaddress_space* vaddr, struct vaddress_request req)
+{
+	assert (req.align && (req.align & (req.align - 1)) == 0,
+			"Alignment must be a power of two");
+
+	void* begin = vaddr->space_begin;
+	void* end = vaddr->space_end;
+	void* split = vaddr->large_split;
+
+	bool large = req.align >= vaddr->large_align;
+	req.lo = split && large ? split : begin;
+	req.hi = split && !large ? split : end;
+
+	void* p = vaddress_allocate_in (vaddr, &req);
+
+	if (!p && split) {
+		// Own part is full, borrow from the other
+		req.lo = begin;
+		req.hi = end;
+		p = vaddress_allocate_in (vaddr, &req);
+	}
+	return p;
+}
+
+void*
+vaddress_allocate_aligned (struct vaddress_space* vaddr,
+						   size_t size, size_t align)
+{
+	return region_allocate (vaddr, (struct vaddress_request) {
+		.size = size,
+		.align = align,
+		.backing = VADDRESS_BACKING_NONE,
+	});
+}
+
+void*
+vaddress_allocate (struct vaddress_space* vaddr, size_t size)
+{
+	return vaddress_allocate_aligned (vaddr, size, 1);
+}
+
+bool
+vaddress_extend (struct vaddress_space* vaddr, void* address,
+				 size_t size, size_t new_size)
+{
+	void* end = address + size;
+	void* new_end = address + new_size;
+
+	if (new_size < size || new_end > vaddr->space_end)
+		return false;
+
+	// The range must run up to the end of its region, or something else
+	// was merged in just above it
+	struct address_region* node = region_find_end_above (vaddr, end - 1);
+	if (!node || node->begin > address || node->end != end)
+		return false;
+
+	if (node->next && node->next->begin < new_end)
+		return false;
+
+	struct vaddress_request req = {
+		.size = new_size - size,
+		.flags = node->flags,
+		.backing = node->backing,
+	};
+	region_place (vaddr, node->next, end, &req);
+	return true;
+}
+
+void*
+vaddress_reserve (struct vaddress_space* vaddr, size_t size, size_t align,
+				  enum mmu_flags flags, enum vaddress_backing backing)
+{
+	return region_allocate (vaddr, (struct vaddress_request) {
+		.size = ROUND_UP_P2 (size, PAGE_SIZE),
+		.align = MAX (align, PAGE_SIZE),
+		.flags = flags,
+		.backing = backing,
+	});
 }
 
 void
-vaddress_free (struct vaddress_space* vaddr, void* address, size_t size)
+vaddress_space_split (struct vaddress_space* vaddr,
+					  void* split, size_t large_align)
 {
-	// This is a mess...
-	struct address_region** prev = &vaddr->allocated;
-	struct address_region* allocated = *prev;
-	void* address_end = address + size;
+	assert (split > vaddr->space_begin && split < vaddr->space_end,
+			"Split must be inside the space");
 
-	while ( allocated ) {
-		struct address_region* next = allocated->next;
+	vaddr->large_split = split;
+	vaddr->large_align = large_align;
+}
 
-		if (address_end < allocated->begin) {
-			return;
-		}
+/* Part [begin, end) of region is going away, free any pages filled in */
+static void
+region_release (struct vaddress_space* vaddr,
+				const struct address_region* region, void* begin, void* end)
+{
+	if (region->backing != VADDRESS_BACKING_ZERO)
+		return;
 
-		else if (allocated->end < address) {
-			prev = &allocated->next;
-		}
+	// Only whole pages, a page partly still in use stays
+	begin = (void*)ROUND_UP_P2 ((uintptr_t)MAX (begin, region->begin), PAGE_SIZE);
+	end = (void*)ROUND_DOWN_P2 ((uintptr_t)MIN (end, region->end), PAGE_SIZE);
+
+	if (begin < end)
+		mmu_remove_free (mmu_top_page, begin, end - begin, vaddr->pmm);
+}
+
+bool
+vaddress_fault (struct vaddress_space* vaddr, void* address, bool is_write)
+{
+	struct address_region* region = region_find_end_above (vaddr, address);
 
-		else if (address <= allocated->begin && allocated->end <= address_end) {
+	if (!region || address < region->begin
+		|| region->backing != VADDRESS_BACKING_ZERO)
+		return false;
+
+	if (is_write && !(region->flags & MEMORY_WRITE))
+		return false;
+
+	physical_t page = pmm_allocate_zeroed_page (vaddr->pmm);
+	if (!page)
+		return false;
+
+	void* base = (void*)ROUND_DOWN_P2 ((uintptr_t)address, PAGE_SIZE);
+	mmu_assign_1 (mmu_top_page, region->flags, page, base);
+	return true;
+}
+
+void
+vaddress_free (struct vaddress_space* vaddr, void* address, size_t size)
+{
+	void* address_end = address + size;
+	struct address_region* allocated = region_find_end_above (vaddr, address);
+
+	while ( allocated && allocated->begin < address_end ) {
+		region_release (vaddr, allocated, address, address_end);
+
+		if (address <= allocated->begin && allocated->end <= address_end) {
 			// Delete whole region
-			*prev = next;
-			allocated->next = vaddr->unused;
-			vaddr->unused = allocated;
+			allocated = region_erase (vaddr, allocated);
+			continue;
 		}
 
 		else if (address <= allocated->begin) {
 			// Shift block start
-			allocated->end = address_end;
-			prev = &allocated->next;
+			allocated->begin = address_end;
+			region_changed (vaddr, allocated);
 		}
 
 		else if (allocated->end <= address_end) {
 			// Shift block end
 			allocated->end = address;
-			prev = &allocated->next;
+			region_changed (vaddr, allocated);
 		}
 
 		else {
 			// Split block
-			struct address_region* region = find_free_node (vaddr);
-			region->end = allocated->end;
-			region->begin = address_end;
-			region->next = next;
+			void* end = allocated->end;
 			allocated->end = address;
-			allocated->next = region;
+			region_changed (vaddr, allocated);
 
-			prev = &region->next;
+			struct address_region* region = region_insert (vaddr, address_end, end);
+			region->flags = allocated->flags;
+			region->backing = allocated->backing;
+			return;
 		}
 
-		allocated = next;
+		allocated = allocated->next;
 	}
 }
 
 
+/* Checks tree order, balance and cached gaps. Returns subtree height */
+static int
+region_check (struct vaddress_space* vaddr, struct address_region* node)
+{
+	if (!node)
+		return 0;
+
+	int left = region_check (vaddr, node->left);
+	int right = region_check (vaddr, node->right);
+
+	assert (left - right <= 1 && right - left <= 1, "vaddr tree unbalanced");
+	assert (node->height == 1 + MAX (left, right), "vaddr height wrong");
+	assert (node->max_gap == MAX (region_gap (vaddr, node),
+								  MAX (region_max_gap (node->left),
+									   region_max_gap (node->right))),
+			"vaddr gap wrong");
+	assert (!node->left || node->left->parent == node, "vaddr parent wrong");
+	assert (!node->right || node->right->parent == node, "vaddr parent wrong");
+
+	return node->height;
+}
+
 void
 vaddress_print (struct vaddress_space* vaddr)
 {
 	struct address_region* region;
-	struct storage_block* blk;
 
 	printf ("vaddr %p-%p\n", vaddr->space_begin, vaddr->space_end);
+	printf ("\tcache pages: %zu objects: %zu\n",
+			vaddress_cache.pages, vaddress_cache.objects);
 
-	int regions = 0;
-	int blocks = 0;
 	int regions_used = 0;
-	int regions_unused = 0;
-
-	for ( blk = vaddr->storage; blk; blk = blk->next ) {
-		blocks++;
-		regions += blk->entries;
-	}
-
-	printf ("\tstorage blocks: %i nodes: %i\n", blocks, regions);
-
-	for ( region = vaddr->unused; region; region = region->next) {
-		regions_unused++;
-	}
 
-	for ( region = vaddr->allocated; region; region = region->next) {
+	for ( region = region_first (vaddr); region; region = region->next) {
 		regions_used++;
 		printf ("\t%p-%p\n", region->begin, region->end);
+		// Touching regions are fine as long as they can't be merged
+		assert (!region->next || region->end < region->next->begin
+				|| (region->end == region->next->begin
+					&& (region->flags != region->next->flags
+						|| region->backing != region->next->backing)),
+				"vaddr regions out of order");
 	}
 
-	printf ("\tnodes used: %i unused: %i\n", regions_used, regions_unused);
+	printf ("\tnodes: %i height: %i\n",
+			regions_used, region_check (vaddr, vaddr->root));
 
-	assert (regions == regions_used + regions_unused, "Region lost from vaddr!");
+	assert (regions_used == vaddr->nodes, "Region lost from vaddr!");
 }
@@ -1,15 +1,46 @@
 #pragma once
 
 #include <stddef.h>
+#include "drivers/mmu.h"
 
 struct vaddress_space;
 struct pmm;
 
 /* Create a new address space structure */
 struct vaddress_space* vaddress_space_new (struct pmm*, void* begin, void* end);
+/* Frees the space, unmapping any pages still filled in by vaddress_fault */
 void vaddress_space_free (struct vaddress_space*);
 
 void* vaddress_allocate (struct vaddress_space*, size_t size);
+
+/* Grow the allocated range [address, address + size) in place to new_size.
+ * Fails if the space just above it is not free */
+bool vaddress_extend (struct vaddress_space*, void* address,
+					  size_t size, size_t new_size);
+
+/* Allocate size bytes starting at a multiple of align (a power of two),
+ * e.g. 2M or 1G for ranges to be mapped with huge pages */
+void* vaddress_allocate_aligned (struct vaddress_space*, size_t size, size_t align);
+
+/* Keep large aligned ranges apart from small ones: requests aligned to at
+ * least large_align come from [split, end) of the space, all others from
+ * [begin, split). Either may spill into the other part once its own is full */
+void vaddress_space_split (struct vaddress_space*, void* split, size_t large_align);
+
+/* How a region is backed by memory */
+enum vaddress_backing {
+	VADDRESS_BACKING_NONE, // Caller maps pages itself (vaddress_allocate)
+	VADDRESS_BACKING_ZERO, // Zeroed pages mapped by vaddress_fault
+};
+
+/* Reserve a page aligned range without any memory behind it yet. Pages are
+ * mapped with flags as they are first touched, and freed with the range */
+void* vaddress_reserve (struct vaddress_space*, size_t size, size_t align,
+						enum mmu_flags flags, enum vaddress_backing);
+
+/* Page fault on a missing page at address. Fills it in if it is part of a
+ * reserved range, and is_write is allowed. Returns false if not handled */
+bool vaddress_fault (struct vaddress_space*, void* address, bool is_write);
 void vaddress_free (struct vaddress_space*, void* address, size_t size);
 
 void vaddress_print (struct vaddress_space*);